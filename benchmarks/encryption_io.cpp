@@ -0,0 +1,278 @@
+/*
+* Encryption I/O benchmark: compares iostream file access with the PosixFile and MappedFile
+* paths the encryption code uses, and times whole-file encryption and decryption, for file
+* sizes from 4 KiB up to 1 GiB. The old columns time the encryption code as it was before
+* chunking: one AES-256-GCM message written with ofstream and read back with ifstream. The
+* rewrite column re-encrypts a file with one byte changed, which large files do in place.
+* Each size is run with random contents and, in the rows marked text, with log lines, which
+* small files store compressed. Every write but the rewrite removes the file first, so no
+* column pays for truncating the previous run's file.
+*
+* A second table times, from 1 MiB up, importing a host file with encryptStream and reading
+* it back with decryptStream under each AsyncIo backend: io_uring, the I/O threads, and
+* synchronous reads and writes (EFS_ASYNC_IO=threads and off).
+*
+* Usage: encryption_io_benchmark [directory] [max size in MiB]
+* Scratch files are written to directory (default /tmp) and removed afterwards.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "encryption/encryption.h"
+#include "helpers/mapped_file.h"
+#include "helpers/posix_file.h"
+
+namespace {
+
+constexpr size_t kRecordSize = ChunkFormat::kDefaultChunkSize + CHUNK_TAG_SIZE + CHUNK_NONCE_SIZE + CHUNK_FINGERPRINT_SIZE;
+
+/// Best time of several runs, in seconds; small sizes get more runs to smooth out noise
+template <typename Body>
+double bestOf(size_t size, Body&& body) {
+    int runs = size <= (1 << 20) ? 50 : size <= (64 << 20) ? 5 : 2;
+    double best = 1e30;
+    for (int i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// One write call per chunk record through a stream, as the encryption code used to do
+void writeStream(const std::string& path, const std::vector<char>& data) {
+    std::ofstream output(path, std::ios::binary);
+    for (size_t offset = 0; offset < data.size(); offset += kRecordSize) {
+        output.write(data.data() + offset, std::min(kRecordSize, data.size() - offset));
+    }
+}
+
+// One pwrite per batch of records
+void writePosix(const std::string& path, const std::vector<char>& data) {
+    PosixFile output;
+    output.openForWrite(path);
+    size_t batch = 8 * 1024 * 1024;
+    for (size_t offset = 0; offset < data.size(); offset += batch) {
+        output.append(data.data() + offset, std::min(batch, data.size() - offset));
+    }
+    output.close();
+}
+
+// The whole file as one GCM message behind its IV and tag, as encryptFile wrote it before
+// chunking
+void encryptOld(const std::string& path, const std::string& content, const std::vector<uint8_t>& key) {
+    uint8_t iv[16], tag[TAG_SIZE];
+    RAND_bytes(iv, sizeof(iv));
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, sizeof(iv), nullptr);
+    EVP_EncryptInit_ex(ctx, nullptr, nullptr, key.data(), iv);
+    std::vector<unsigned char> buffer(content.begin(), content.end());
+    int len = 0;
+    EVP_EncryptUpdate(ctx, buffer.data(), &len, buffer.data(), static_cast<int>(buffer.size()));
+    EVP_EncryptFinal_ex(ctx, buffer.data() + len, &len);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_SIZE, tag);
+    EVP_CIPHER_CTX_free(ctx);
+
+    std::ofstream output(path, std::ios::binary);
+    output.write(reinterpret_cast<char*>(iv), sizeof(iv));
+    output.write(reinterpret_cast<char*>(tag), TAG_SIZE);
+    output.write(reinterpret_cast<char*>(buffer.data()), buffer.size());
+}
+
+std::string decryptOld(const std::string& path, const std::vector<uint8_t>& key) {
+    std::ifstream input(path, std::ios::binary);
+    uint8_t iv[16], tag[TAG_SIZE];
+    input.read(reinterpret_cast<char*>(iv), sizeof(iv));
+    input.read(reinterpret_cast<char*>(tag), TAG_SIZE);
+    std::vector<unsigned char> buffer((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    std::vector<unsigned char> plaintext(buffer.size());
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, sizeof(iv), nullptr);
+    EVP_DecryptInit_ex(ctx, nullptr, nullptr, key.data(), iv);
+    int len = 0;
+    EVP_DecryptUpdate(ctx, plaintext.data(), &len, buffer.data(), static_cast<int>(buffer.size()));
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, tag);
+    if (1 != EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len)) {
+        std::fprintf(stderr, "old format: tag verification failed\n");
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return std::string(plaintext.begin(), plaintext.end());
+}
+
+size_t readStream(const std::string& path) {
+    std::ifstream input(path, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    return contents.size();
+}
+
+size_t readPosix(const std::string& path) {
+    PosixFile input;
+    uint64_t size = 0;
+    input.openForRead(path);
+    input.size(size);
+    input.advise(POSIX_FADV_SEQUENTIAL);
+    std::string contents(size, '\0');
+    input.readAt(&contents[0], size, 0);
+    return contents.size();
+}
+
+size_t readMapped(const std::string& path) {
+    MappedFile input;
+    input.open(path);
+    input.advise(MADV_SEQUENTIAL);
+    // Touch every page, as decryption would.
+    volatile uint8_t sink = 0;
+    for (size_t offset = 0; offset < input.size(); offset += 4096) {
+        sink = sink ^ input.data()[offset];
+    }
+    return input.size();
+}
+
+// Discards what is written to it, so decryptStream is timed without a destination
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+};
+
+double mbPerSecond(size_t size, double seconds) {
+    return seconds > 0 ? size / seconds / (1024.0 * 1024.0) : 0;
+}
+
+std::string sizeLabel(size_t size) {
+    if (size >= (1 << 30)) return std::to_string(size >> 30) + " GiB";
+    if (size >= (1 << 20)) return std::to_string(size >> 20) + " MiB";
+    return std::to_string(size >> 10) + " KiB";
+}
+
+// Log lines with a running counter and timestamp, which deflate shrinks about sevenfold
+std::vector<char> logText(size_t size) {
+    std::vector<char> data;
+    data.reserve(size + 128);
+    char line[128];
+    for (unsigned long i = 0; data.size() < size; ++i) {
+        int length = std::snprintf(line, sizeof(line), "2024-05-01T13:%02lu:%02lu.%03lu INFO request %lu served in %lu ms\n",
+                                   i / 60000 % 60, i / 1000 % 60, i % 1000, i, i * 7 % 250);
+        data.insert(data.end(), line, line + length);
+    }
+    data.resize(size);
+    return data;
+}
+
+void runRow(const std::string& label, const std::string& path, const std::vector<uint8_t>& key, const std::vector<char>& data) {
+    size_t size = data.size();
+    std::string content(data.begin(), data.end());
+
+    double streamWrite = bestOf(size, [&] {
+        std::remove(path.c_str());
+        writeStream(path, data);
+    });
+    double posixWrite = bestOf(size, [&] {
+        std::remove(path.c_str());
+        writePosix(path, data);
+    });
+    double streamRead = bestOf(size, [&] { readStream(path); });
+    double posixRead = bestOf(size, [&] { readPosix(path); });
+    double mappedRead = bestOf(size, [&] { readMapped(path); });
+    double oldEncrypt = bestOf(size, [&] {
+        std::remove(path.c_str());
+        encryptOld(path, content, key);
+    });
+    double oldDecrypt = bestOf(size, [&] { decryptOld(path, key); });
+    // Remove the file first, so each run writes it whole.
+    double encrypt = bestOf(size, [&] {
+        std::remove(path.c_str());
+        Encryption::encryptFile(path, content, key);
+    });
+    double decrypt = bestOf(size, [&] { Encryption::decryptFile(path, key); });
+    double rewrite = bestOf(size, [&] {
+        content[size / 2] ^= 1;
+        Encryption::encryptFile(path, content, key);
+    });
+
+    std::printf("%-12s %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f\n", label.c_str(),
+                mbPerSecond(size, streamWrite), mbPerSecond(size, posixWrite), mbPerSecond(size, streamRead),
+                mbPerSecond(size, posixRead), mbPerSecond(size, mappedRead), mbPerSecond(size, oldEncrypt),
+                mbPerSecond(size, oldDecrypt), mbPerSecond(size, encrypt), mbPerSecond(size, decrypt),
+                mbPerSecond(size, rewrite));
+}
+
+void runAsyncRow(const std::string& label, const std::string& path, const std::vector<uint8_t>& key, const std::vector<char>& data) {
+    size_t size = data.size();
+    std::string source = path + ".source";
+    writePosix(source, data);
+    PosixFile input;
+    input.openForRead(source);
+
+    const char* backends[] = {"uring", "threads", "off"};
+    double imports[3], scans[3];
+    for (int i = 0; i < 3; ++i) {
+        setenv("EFS_ASYNC_IO", backends[i], 1);
+        imports[i] = bestOf(size, [&] {
+            std::remove(path.c_str());
+            Encryption::encryptStream(input, path, key);
+        });
+        scans[i] = bestOf(size, [&] {
+            NullBuffer discard;
+            std::ostream output(&discard);
+            Encryption::decryptStream(path, key, output);
+        });
+    }
+    unsetenv("EFS_ASYNC_IO");
+    input.close();
+    std::remove(source.c_str());
+
+    std::printf("%-12s %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f\n", label.c_str(), mbPerSecond(size, imports[0]),
+                mbPerSecond(size, imports[1]), mbPerSecond(size, imports[2]), mbPerSecond(size, scans[0]),
+                mbPerSecond(size, scans[1]), mbPerSecond(size, scans[2]));
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string directory = argc > 1 ? argv[1] : "/tmp";
+    size_t maxSize = (argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1024) << 20;
+    std::string path = directory + "/encryption_io_benchmark.bin";
+    std::vector<uint8_t> key(KEY_SIZE);
+    RAND_bytes(key.data(), KEY_SIZE);
+    auto randomData = [](size_t size) {
+        std::vector<char> data(size);
+        RAND_bytes(reinterpret_cast<unsigned char*>(data.data()), static_cast<int>(std::min<size_t>(size, 1 << 20)));
+        for (size_t offset = 1 << 20; offset < size; offset += 1 << 20) {
+            std::memcpy(data.data() + offset, data.data(), std::min<size_t>(1 << 20, size - offset));
+        }
+        return data;
+    };
+
+    std::printf("%-12s %9s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n", "size", "ofstream", "pwrite", "ifstream",
+                "pread", "mmap", "old enc", "old dec", "encrypt", "decrypt", "rewrite");
+    std::printf("%-12s %9s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n", "", "MB/s", "MB/s", "MB/s", "MB/s", "MB/s",
+                "MB/s", "MB/s", "MB/s", "MB/s", "MB/s");
+    for (size_t size = 4 * 1024; size <= maxSize; size *= 4) {
+        runRow(sizeLabel(size), path, key, randomData(size));
+        runRow(sizeLabel(size) + " text", path, key, logText(size));
+    }
+
+    std::printf("\n%-12s %9s %9s %9s %9s %9s %9s\n", "size", "import", "import", "import", "scan", "scan", "scan");
+    std::printf("%-12s %9s %9s %9s %9s %9s %9s\n", "MB/s", "io_uring", "threads", "sync", "io_uring", "threads", "sync");
+    for (size_t size = 1 << 20; size <= maxSize; size *= 4) {
+        runAsyncRow(sizeLabel(size), path, key, randomData(size));
+    }
+    std::remove(path.c_str());
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+* Chunk digest: a MAC over the index and tag of every chunk of a file, kept in the file's
+* metadata so chunks from earlier versions of the file cannot be spliced into it.
+*
+* The digest is the XOR over all chunks of a PRF of (index, tag), AES-256 CBC-MAC of the two
+* blocks index || tag under a key derived from the file's data key. A chunk's term cancels
+* itself out, so replacing a chunk, or appending to a file, only takes the old and new tags.
+*/
+
+#ifndef CHUNK_DIGEST_H
+#define CHUNK_DIGEST_H
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "encryption/chunk_format.h"
+
+class ChunkDigest {
+public:
+    /// \param dataKey   Key the file's chunks are sealed under
+    /// \param value     Digest read from a file to update, or null to start empty
+    explicit ChunkDigest(const std::vector<uint8_t>& dataKey, const uint8_t* value = nullptr);
+    ~ChunkDigest() { EVP_CIPHER_CTX_free(ctx_); }
+
+    ChunkDigest(const ChunkDigest&) = delete;
+    ChunkDigest& operator=(const ChunkDigest&) = delete;
+
+    /// Whether the digest key could be set up
+    bool isReady() const { return ctx_ != nullptr; }
+
+    /// Add a chunk to the digest, or take it out again if it is already in
+    /// \return False if the PRF failed
+    bool toggle(uint64_t index, const uint8_t* tag);
+
+    const uint8_t* value() const { return value_; }
+
+    /// Compare with a digest read from a file, in constant time
+    bool matches(const uint8_t* digest) const { return CRYPTO_memcmp(value_, digest, CHUNK_DIGEST_SIZE) == 0; }
+
+private:
+    static constexpr char kLabel[] = "EFS chunk digest";
+
+    EVP_CIPHER_CTX* ctx_ = nullptr;
+    uint8_t value_[CHUNK_DIGEST_SIZE] = {};
+};
+
+ChunkDigest::ChunkDigest(const std::vector<uint8_t>& dataKey, const uint8_t* value) {
+    if (value != nullptr) {
+        std::memcpy(value_, value, CHUNK_DIGEST_SIZE);
+    }
+    uint8_t digestKey[32];
+    unsigned int length = 0;
+    if (HMAC(EVP_sha256(), dataKey.data(), static_cast<int>(dataKey.size()), reinterpret_cast<const unsigned char*>(kLabel),
+             sizeof(kLabel) - 1, digestKey, &length) == nullptr) {
+        return;
+    }
+    ctx_ = EVP_CIPHER_CTX_new();
+    if (ctx_ == nullptr || 1 != EVP_EncryptInit_ex(ctx_, EVP_aes_256_ecb(), nullptr, digestKey, nullptr) ||
+        1 != EVP_CIPHER_CTX_set_padding(ctx_, 0)) {
+        EVP_CIPHER_CTX_free(ctx_);
+        ctx_ = nullptr;
+    }
+    OPENSSL_cleanse(digestKey, sizeof(digestKey));
+}
+
+bool ChunkDigest::toggle(uint64_t index, const uint8_t* tag) {
+    static_assert(CHUNK_TAG_SIZE == 16 && CHUNK_DIGEST_SIZE == 16, "the PRF works on single AES blocks");
+    uint8_t block[16] = {}, term[16];
+    std::memcpy(block, &index, sizeof(index));
+    int length = 0;
+    if (ctx_ == nullptr || 1 != EVP_EncryptUpdate(ctx_, block, &length, block, sizeof(block))) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(block); ++i) {
+        block[i] ^= tag[i];
+    }
+    if (1 != EVP_EncryptUpdate(ctx_, term, &length, block, sizeof(block))) {
+        return false;
+    }
+    for (size_t i = 0; i < CHUNK_DIGEST_SIZE; ++i) {
+        value_[i] ^= term[i];
+    }
+    return true;
+}
+
+#endif // CHUNK_DIGEST_H
@@ -0,0 +1,289 @@
+/*
+* Chunked file format: segmented AEAD layout for encrypted file contents.
+*
+* Layout (native byte order):
+*   ChunkedFileHeader
+*   wrapped data key                    WRAPPED_KEY_SIZE bytes, version 2 and later
+*   FileMetadata                        version 3 and later, without chunk_digest in version 3
+*   chunk records, each ciphertext followed by its CHUNK_TAG_SIZE-byte tag and, from
+*                                       version 4, its nonce and fingerprint
+*
+* Chunks are encrypted under a random per-file data key, stored in the header wrapped
+* (RFC 3394) under the owner's key. Version 1 files have no data key and use the owner's
+* key directly. A rewrite keeps the file's data key, so a file shared through a link file
+* stays readable by its recipients.
+*
+* A link file stands in for a shared file in the recipient's tree:
+*   LinkFileHeader                      data key wrapped under the recipient's key
+*   target path                         target_size bytes, relative to the link's directory
+*
+* Every chunk but the last carries exactly chunk_size bytes of plaintext; the last one
+* carries the remainder and may be empty. Chunk i is sealed with the header's cipher suite
+* under its nonce XOR i, with the fixed header and a last-chunk flag as additional data, so
+* chunks can be decrypted on their own while reordering, truncation and header tampering
+* still fail authentication. The suite byte was zero, AES-256-GCM, in files written before
+* it was introduced.
+*
+* Before version 4 every chunk took the file nonce, which changes with every write, so a
+* file had to be rewritten whole. From version 4 each record carries a random nonce of its
+* own, so single chunks can be resealed in place, and a fingerprint of its plaintext: a MAC
+* under a key derived from the data key and the chunk's nonce, against which new contents
+* are compared without decrypting the chunk. Readers ignore fingerprints; one that does not
+* match only makes a writer reseal its chunk. The metadata keeps a digest of every chunk's
+* index and tag, an XOR of PRF outputs that is updated chunk by chunk, and every read
+* checks it, so chunks left over from earlier versions of the file cannot be spliced in.
+* Reads of a range decrypt only the chunks they touch but take every chunk's tag into the
+* digest. Chunks resealed in place go through an update journal (encryption/update_journal.h)
+* with the metadata that commits them, so a crash cannot leave only some of them written.
+*
+* With kFlagCompressed set, the chunks hold the contents compressed as a whole (see
+* helpers/compression.h) rather than the contents themselves. Only small files are
+* compressed.
+*
+* The metadata block records the plaintext size and creation and modification times, so a
+* file can be listed from its first few hundred bytes. It carries its own AEAD tag under the
+* data key, over the fixed header and the metadata fields, with a random nonce of its own:
+* metadata can be rewritten without resealing any chunk. It is stored in field order, with
+* the tag last. An uncompressed file ends where its metadata's plaintext size says: an
+* append writes its new records past that end first, and the metadata commits them.
+*
+* Files written before this format start with a 16-byte IV instead of the magic and are
+* still read as a single GCM message.
+*/
+
+#ifndef CHUNK_FORMAT_H
+#define CHUNK_FORMAT_H
+
+#include <openssl/rand.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "encryption/cipher_suite.h"
+
+#define CHUNK_NONCE_SIZE 12 //bytes
+#define CHUNK_TAG_SIZE 16 //bytes
+#define WRAPPED_KEY_SIZE 40 //bytes
+#define CHUNK_DIGEST_SIZE 16 //bytes
+#define CHUNK_FINGERPRINT_SIZE 16 //bytes
+
+struct ChunkedFileHeader {
+    char magic[8];
+    uint16_t version;
+    uint8_t suite;
+    uint8_t flags;
+    uint32_t header_size;
+    uint32_t chunk_size;
+    uint8_t file_nonce[CHUNK_NONCE_SIZE];
+};
+static_assert(sizeof(ChunkedFileHeader) == 32, "ChunkedFileHeader must stay packed");
+
+/// Times are nanoseconds since the Unix epoch
+struct FileMetadata {
+    uint64_t plaintext_size;
+    int64_t created_ns;
+    int64_t modified_ns;
+    uint8_t nonce[CHUNK_NONCE_SIZE];
+    uint8_t reserved[4];
+    uint8_t chunk_digest[CHUNK_DIGEST_SIZE];
+    uint8_t tag[CHUNK_TAG_SIZE];
+};
+static_assert(sizeof(FileMetadata) == 72, "FileMetadata must stay packed");
+
+struct LinkFileHeader {
+    char magic[8];
+    uint16_t version;
+    uint16_t flags;
+    uint32_t target_size;
+    uint8_t wrapped_key[WRAPPED_KEY_SIZE];
+};
+static_assert(sizeof(LinkFileHeader) == 56, "LinkFileHeader must stay packed");
+
+/// Where the chunks of a file are, derived from its header and size on disk
+struct ChunkLayout {
+    uint64_t chunk_count;
+    uint64_t last_record_size;
+    uint64_t plaintext_size;
+    uint64_t record_overhead;
+
+    uint64_t recordOffset(const ChunkedFileHeader& header, uint64_t index) const {
+        return header.header_size + index * (header.chunk_size + record_overhead);
+    }
+    uint64_t recordSize(const ChunkedFileHeader& header, uint64_t index) const {
+        return index + 1 == chunk_count ? last_record_size : header.chunk_size + record_overhead;
+    }
+    uint64_t tagOffset(const ChunkedFileHeader& header, uint64_t index) const {
+        return recordOffset(header, index) + recordSize(header, index) - record_overhead;
+    }
+};
+
+class ChunkFormat {
+public:
+    static constexpr char kMagic[8] = {'E', 'F', 'S', 'C', 'H', 'N', 'K', '\0'};
+    static constexpr char kLinkMagic[8] = {'E', 'F', 'S', 'L', 'I', 'N', 'K', '\0'};
+    static constexpr uint16_t kVersion = 4;
+    static constexpr uint16_t kLinkVersion = 1;
+    static constexpr uint32_t kDefaultChunkSize = 64 * 1024;
+    static constexpr uint32_t kMaxChunkSize = 16 * 1024 * 1024;
+    static constexpr uint8_t kFlagCompressed = 0x01;
+
+    /// Whether a file starting with these bytes uses the chunked format
+    static bool isChunked(const void* prefix, size_t length);
+
+    /// Whether a file starting with these bytes is a link to a shared file
+    static bool isLink(const void* prefix, size_t length);
+
+    /// Whether chunks are encrypted under a wrapped data key stored after the header
+    static bool hasDataKey(const ChunkedFileHeader& header) { return header.version >= 2; }
+
+    /// Whether a FileMetadata block follows the wrapped data key
+    static bool hasMetadata(const ChunkedFileHeader& header) { return header.version >= 3; }
+    static constexpr size_t kMetadataOffset = sizeof(ChunkedFileHeader) + WRAPPED_KEY_SIZE;
+
+    /// Whether chunk records end with a nonce of their own and a fingerprint, after the tag
+    static bool hasRecordNonces(const ChunkedFileHeader& header) { return header.version >= 4; }
+
+    /// Whether the metadata block keeps a digest of the chunk tags
+    static bool hasChunkDigest(const ChunkedFileHeader& header) { return header.version >= 4; }
+
+    /// Bytes a chunk record adds to its plaintext
+    static size_t recordOverhead(const ChunkedFileHeader& header) {
+        return CHUNK_TAG_SIZE + (hasRecordNonces(header) ? CHUNK_NONCE_SIZE + CHUNK_FINGERPRINT_SIZE : 0);
+    }
+
+    /// Size of the metadata block on disk
+    static size_t metadataSize(const ChunkedFileHeader& header) {
+        return sizeof(FileMetadata) - (hasChunkDigest(header) ? 0 : CHUNK_DIGEST_SIZE);
+    }
+
+    /// Read or write a metadata block of metadataSize(header) bytes
+    static void readMetadata(const ChunkedFileHeader& header, const uint8_t* data, FileMetadata& metadata);
+    static void writeMetadata(const ChunkedFileHeader& header, const FileMetadata& metadata, uint8_t* data);
+
+    /// Header for a new file with a fresh file nonce
+    static ChunkedFileHeader newHeader(CipherSuite suite, uint32_t chunkSize = kDefaultChunkSize);
+
+    static CipherSuite suiteOf(const ChunkedFileHeader& header) { return static_cast<CipherSuite>(header.suite); }
+
+    static bool isCompressed(const ChunkedFileHeader& header) { return (header.flags & kFlagCompressed) != 0; }
+
+    /// Check a header read from disk
+    /// \return False if the header cannot belong to a file this code wrote
+    static bool isValidHeader(const ChunkedFileHeader& header);
+
+    /// Nonce of one chunk: the record's own nonce, or before version 4 the file nonce, with
+    /// the chunk index XORed into its last 8 bytes
+    static void chunkNonce(const ChunkedFileHeader& header, uint64_t index, const uint8_t* recordNonce, uint8_t* nonce);
+
+    /// Additional data of one chunk: the fixed header followed by the last-chunk flag
+    static void chunkAad(const ChunkedFileHeader& header, bool last, uint8_t* aad);
+    static constexpr size_t kAadSize = sizeof(ChunkedFileHeader) + 1;
+
+    /// Additional data of the metadata block: the fixed header followed by every metadata
+    /// field but the tag
+    /// \return Its size, at most kMetadataAadSize
+    static size_t metadataAad(const ChunkedFileHeader& header, const FileMetadata& metadata, uint8_t* aad);
+    static constexpr size_t kMetadataAadSize = sizeof(ChunkedFileHeader) + offsetof(FileMetadata, tag);
+
+    /// Compute the chunk layout of a file of fileSize bytes
+    /// \return False if no sequence of chunks fits in that size
+    static bool layout(const ChunkedFileHeader& header, uint64_t fileSize, ChunkLayout& layout);
+
+    /// Compute the chunk layout of an uncompressed file from the plaintext size in its
+    /// metadata. Bytes past the last record are a torn tail, left by an append that was
+    /// interrupted before it committed, and are not part of the file.
+    /// \return False if the records do not fit in fileSize bytes
+    static bool layoutOf(const ChunkedFileHeader& header, uint64_t plaintextSize, uint64_t fileSize, ChunkLayout& layout);
+};
+
+bool ChunkFormat::isChunked(const void* prefix, size_t length) {
+    return length >= sizeof(kMagic) && std::memcmp(prefix, kMagic, sizeof(kMagic)) == 0;
+}
+
+bool ChunkFormat::isLink(const void* prefix, size_t length) {
+    return length >= sizeof(kLinkMagic) && std::memcmp(prefix, kLinkMagic, sizeof(kLinkMagic)) == 0;
+}
+
+ChunkedFileHeader ChunkFormat::newHeader(CipherSuite suite, uint32_t chunkSize) {
+    ChunkedFileHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.suite = static_cast<uint8_t>(suite);
+    header.flags = 0;
+    header.header_size = sizeof(ChunkedFileHeader) + WRAPPED_KEY_SIZE + metadataSize(header);
+    header.chunk_size = chunkSize;
+    RAND_bytes(header.file_nonce, CHUNK_NONCE_SIZE);
+    return header;
+}
+
+bool ChunkFormat::isValidHeader(const ChunkedFileHeader& header) {
+    return isChunked(header.magic, sizeof(header.magic)) &&
+           header.version >= 1 && header.version <= kVersion &&
+           CipherSuites::isKnown(header.suite) && (header.flags & ~kFlagCompressed) == 0 &&
+           header.header_size >= sizeof(ChunkedFileHeader) + (hasDataKey(header) ? WRAPPED_KEY_SIZE : 0) +
+                                     (hasMetadata(header) ? metadataSize(header) : 0) &&
+           header.chunk_size > 0 && header.chunk_size <= kMaxChunkSize;
+}
+
+bool ChunkFormat::layout(const ChunkedFileHeader& header, uint64_t fileSize, ChunkLayout& layout) {
+    // Every file has at least one record, and the last one holds at least its tag and trailer.
+    layout.record_overhead = recordOverhead(header);
+    uint64_t recordSize = header.chunk_size + layout.record_overhead;
+    if (fileSize < header.header_size + layout.record_overhead) {
+        return false;
+    }
+    uint64_t body = fileSize - header.header_size;
+    layout.chunk_count = (body + recordSize - 1) / recordSize;
+    layout.last_record_size = body - (layout.chunk_count - 1) * recordSize;
+    if (layout.last_record_size < layout.record_overhead) {
+        return false;
+    }
+    layout.plaintext_size = (layout.chunk_count - 1) * header.chunk_size + layout.last_record_size - layout.record_overhead;
+    return true;
+}
+
+bool ChunkFormat::layoutOf(const ChunkedFileHeader& header, uint64_t plaintextSize, uint64_t fileSize, ChunkLayout& layout) {
+    // Records are never smaller than their plaintext, which bounds the arithmetic below.
+    layout.record_overhead = recordOverhead(header);
+    if (fileSize < header.header_size || plaintextSize > fileSize) {
+        return false;
+    }
+    layout.chunk_count = plaintextSize == 0 ? 1 : (plaintextSize + header.chunk_size - 1) / header.chunk_size;
+    layout.last_record_size = plaintextSize - (layout.chunk_count - 1) * header.chunk_size + layout.record_overhead;
+    layout.plaintext_size = plaintextSize;
+    return layout.recordOffset(header, layout.chunk_count - 1) + layout.last_record_size <= fileSize;
+}
+
+void ChunkFormat::chunkNonce(const ChunkedFileHeader& header, uint64_t index, const uint8_t* recordNonce, uint8_t* nonce) {
+    std::memcpy(nonce, hasRecordNonces(header) ? recordNonce : header.file_nonce, CHUNK_NONCE_SIZE);
+    for (size_t i = 0; i < 8; ++i) {
+        nonce[CHUNK_NONCE_SIZE - 1 - i] ^= static_cast<uint8_t>(index >> (8 * i));
+    }
+}
+
+void ChunkFormat::chunkAad(const ChunkedFileHeader& header, bool last, uint8_t* aad) {
+    std::memcpy(aad, &header, sizeof(ChunkedFileHeader));
+    aad[sizeof(ChunkedFileHeader)] = last ? 1 : 0;
+}
+
+void ChunkFormat::readMetadata(const ChunkedFileHeader& header, const uint8_t* data, FileMetadata& metadata) {
+    size_t fields = metadataSize(header) - CHUNK_TAG_SIZE;
+    metadata = FileMetadata{};
+    std::memcpy(&metadata, data, fields);
+    std::memcpy(metadata.tag, data + fields, CHUNK_TAG_SIZE);
+}
+
+void ChunkFormat::writeMetadata(const ChunkedFileHeader& header, const FileMetadata& metadata, uint8_t* data) {
+    size_t fields = metadataSize(header) - CHUNK_TAG_SIZE;
+    std::memcpy(data, &metadata, fields);
+    std::memcpy(data + fields, metadata.tag, CHUNK_TAG_SIZE);
+}
+
+size_t ChunkFormat::metadataAad(const ChunkedFileHeader& header, const FileMetadata& metadata, uint8_t* aad) {
+    size_t fields = metadataSize(header) - CHUNK_TAG_SIZE;
+    std::memcpy(aad, &header, sizeof(ChunkedFileHeader));
+    std::memcpy(aad + sizeof(ChunkedFileHeader), &metadata, fields);
+    return sizeof(ChunkedFileHeader) + fields;
+}
+
+#endif // CHUNK_FORMAT_H
@@ -0,0 +1,117 @@
+/*
+* Cipher context pool: per-thread cache of cipher contexts that are re-keyed between uses
+* instead of being allocated and initialized from scratch for every file operation.
+*
+* Each context in the pool is bound to its cipher once; acquiring a context afterwards only
+* loads a new key and IV.
+*/
+
+#ifndef CIPHER_POOL_H
+#define CIPHER_POOL_H
+
+#include <openssl/evp.h>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+class CipherContextPool {
+public:
+    class Lease;
+
+    /// The calling thread's pool
+    static CipherContextPool& local();
+
+    /// Borrow a context bound to cipher, keyed for one encryption or decryption
+    /// \param cipher     Cipher the context must be bound to
+    /// \param key        Key to load
+    /// \param iv         IV to load
+    /// \param ivLength   Length of iv in bytes
+    /// \param encrypt    Whether the context encrypts or decrypts
+    Lease acquire(const EVP_CIPHER* cipher, const uint8_t* key, const uint8_t* iv, size_t ivLength, bool encrypt);
+
+    ~CipherContextPool();
+
+private:
+    static constexpr size_t kMaxIdleContexts = 8;
+
+    struct Entry {
+        EVP_CIPHER_CTX* ctx;
+        const EVP_CIPHER* cipher;
+        size_t ivLength;
+    };
+
+    void release(const Entry& entry);
+
+    std::vector<Entry> idle_;
+};
+
+/// A context borrowed from a pool; returned to it when the lease goes out of scope, which
+/// must happen on the thread that acquired it
+class CipherContextPool::Lease {
+public:
+    Lease(CipherContextPool* pool, const Entry& entry) : pool_(pool), entry_(entry) {}
+    Lease(Lease&& other) noexcept : pool_(other.pool_), entry_(other.entry_) { other.entry_.ctx = nullptr; }
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+    Lease& operator=(Lease&&) = delete;
+    ~Lease() { if (entry_.ctx) pool_->release(entry_); }
+
+    EVP_CIPHER_CTX* get() const { return entry_.ctx; }
+
+private:
+    CipherContextPool* pool_;
+    Entry entry_;
+};
+
+CipherContextPool& CipherContextPool::local() {
+    thread_local CipherContextPool pool;
+    return pool;
+}
+
+CipherContextPool::Lease CipherContextPool::acquire(const EVP_CIPHER* cipher, const uint8_t* key, const uint8_t* iv, size_t ivLength, bool encrypt) {
+    Entry entry{nullptr, cipher, ivLength};
+    for (size_t i = idle_.size(); i-- > 0;) {
+        if (idle_[i].cipher == cipher && idle_[i].ivLength == ivLength) {
+            entry = idle_[i];
+            idle_.erase(idle_.begin() + i);
+            break;
+        }
+    }
+
+    if (entry.ctx == nullptr) {
+        entry.ctx = EVP_CIPHER_CTX_new();
+        if (entry.ctx == nullptr) {
+            throw std::runtime_error("Cipher context initialization failed.");
+        }
+        // The IV length has to be set before the IV itself is loaded; it stays set across re-keys.
+        if (1 != EVP_CipherInit_ex(entry.ctx, cipher, nullptr, nullptr, nullptr, encrypt ? 1 : 0) ||
+            1 != EVP_CIPHER_CTX_ctrl(entry.ctx, EVP_CTRL_AEAD_SET_IVLEN, static_cast<int>(ivLength), nullptr)) {
+            EVP_CIPHER_CTX_free(entry.ctx);
+            throw std::runtime_error("Cipher initialization failed.");
+        }
+    }
+
+    if (1 != EVP_CipherInit_ex(entry.ctx, nullptr, nullptr, key, iv, encrypt ? 1 : 0)) {
+        EVP_CIPHER_CTX_free(entry.ctx);
+        throw std::runtime_error("Cipher initialization failed.");
+    }
+
+    return Lease(this, entry);
+}
+
+void CipherContextPool::release(const Entry& entry) {
+    if (idle_.size() < kMaxIdleContexts) {
+        idle_.push_back(entry);
+    } else {
+        EVP_CIPHER_CTX_free(entry.ctx);
+    }
+}
+
+CipherContextPool::~CipherContextPool() {
+    for (const Entry& entry : idle_) {
+        EVP_CIPHER_CTX_free(entry.ctx);
+    }
+}
+
+#endif // CIPHER_POOL_H
@@ -0,0 +1,95 @@
+/*
+* Cipher suites: the AEAD algorithms file contents can be encrypted with.
+*
+* Each chunked file records its suite in the header, so files written with different suites
+* can be read side by side. New files use the suite that is fastest on this CPU: AES-256-GCM
+* where the CPU has AES and carry-less multiply instructions, ChaCha20-Poly1305 elsewhere.
+* EFS_CIPHER_SUITE ("aes-256-gcm" or "chacha20-poly1305") overrides the choice.
+*/
+
+#ifndef CIPHER_SUITE_H
+#define CIPHER_SUITE_H
+
+#include <openssl/evp.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+enum class CipherSuite : uint8_t {
+    Aes256Gcm = 0,
+    ChaCha20Poly1305 = 1,
+};
+
+class CipherSuites {
+public:
+    /// Whether a suite id read from a file header names a known suite
+    static bool isKnown(uint8_t suite);
+
+    /// The suite's implementation, fetched once per process
+    static const EVP_CIPHER* cipher(CipherSuite suite);
+
+    static const char* name(CipherSuite suite);
+
+    /// Suite for new files, chosen once from the CPU's features
+    static CipherSuite preferred();
+
+    /// Whether the CPU has instructions that make AES-GCM fast
+    static bool hasAesAcceleration();
+};
+
+bool CipherSuites::isKnown(uint8_t suite) {
+    return suite <= static_cast<uint8_t>(CipherSuite::ChaCha20Poly1305);
+}
+
+const EVP_CIPHER* CipherSuites::cipher(CipherSuite suite) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // An explicit fetch is resolved once, where EVP_aes_256_gcm() is looked up on every init.
+    static EVP_CIPHER* aes = EVP_CIPHER_fetch(nullptr, "AES-256-GCM", nullptr);
+    static EVP_CIPHER* chacha = EVP_CIPHER_fetch(nullptr, "ChaCha20-Poly1305", nullptr);
+    if (suite == CipherSuite::Aes256Gcm && aes != nullptr) {
+        return aes;
+    }
+    if (suite == CipherSuite::ChaCha20Poly1305 && chacha != nullptr) {
+        return chacha;
+    }
+#endif
+    return suite == CipherSuite::ChaCha20Poly1305 ? EVP_chacha20_poly1305() : EVP_aes_256_gcm();
+}
+
+const char* CipherSuites::name(CipherSuite suite) {
+    return suite == CipherSuite::ChaCha20Poly1305 ? "chacha20-poly1305" : "aes-256-gcm";
+}
+
+CipherSuite CipherSuites::preferred() {
+    static const CipherSuite suite = [] {
+        if (const char* configured = std::getenv("EFS_CIPHER_SUITE")) {
+            if (std::strcmp(configured, name(CipherSuite::ChaCha20Poly1305)) == 0) {
+                return CipherSuite::ChaCha20Poly1305;
+            }
+            if (std::strcmp(configured, name(CipherSuite::Aes256Gcm)) == 0) {
+                return CipherSuite::Aes256Gcm;
+            }
+        }
+        return hasAesAcceleration() ? CipherSuite::Aes256Gcm : CipherSuite::ChaCha20Poly1305;
+    }();
+    return suite;
+}
+
+bool CipherSuites::hasAesAcceleration() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__) && defined(__linux__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+#else
+    return false;
+#endif
+}
+
+#endif // CIPHER_SUITE_H
@@ -9,25 +9,146 @@
 #include <openssl/conf.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <string>
 #include <iostream>
-#include <fstream>
+#include <memory>
+#include <filesystem>
 #include <vector>
 
+#include "encryption/chunk_digest.h"
+#include "encryption/chunk_format.h"
+#include "encryption/cipher_pool.h"
+#include "encryption/keyring.h"
+#include "encryption/update_journal.h"
+#include "helpers/async_io.h"
+#include "helpers/compression.h"
+#include "helpers/mapped_file.h"
+#include "helpers/posix_file.h"
+#include "helpers/thread_pool.h"
+
+namespace fs = std::filesystem;
+
 #define BLOCK_SIZE 16 //bytes
 #define KEY_SIZE 32 //bytes
 #define TAG_SIZE 16 //bytes
 #define IV_SIZE 16 //bytes
 
+static_assert(TAG_SIZE == CHUNK_TAG_SIZE, "chunk records carry 16-byte AEAD tags");
+
+/// What statFile reports about a file; times are nanoseconds since the Unix epoch
+struct FileInfo {
+    uint64_t size;
+    int64_t created_ns;
+    int64_t modified_ns;
+    CipherSuite suite;
+    uint32_t chunk_size;
+    bool compressed;
+    bool linked;    ///< The file is a link to a file another user shared; the rest describes that file
+};
+
+/// A user to share a file with: where their link goes and the key it is wrapped under
+struct ShareTarget {
+    std::string linkPath;
+    const std::vector<uint8_t>& recipientKey;
+};
+
 class Encryption {
 public:
+    /// Encrypt content into filePath, compressing it first when it is small and that makes it
+    /// smaller. A large file is updated in place when less than half of its chunks change.
     static void encryptFile(const std::string& filePath, const std::string& content, const std::vector<uint8_t>& key);
     static std::string decryptFile(const std::string& filePath, const std::vector<uint8_t>& key);
 
+    /// Add content to the end of filePath, sealing only the file's last chunk and the new
+    /// ones. Files that cannot grow in place, because they are compressed or of an older
+    /// format, are rewritten whole as encryptFile would, so small files stay compressed.
+    static void appendFile(const std::string& filePath, const std::string& content, const std::vector<uint8_t>& key);
+
+    /// Encrypt input, an open regular file, into filePath, holding a few batches of chunks in
+    /// memory at a time. Reads of the chunks ahead are kept in flight through AsyncIo while
+    /// earlier ones are sealed. Streamed contents are stored uncompressed.
+    static void encryptStream(const PosixFile& input, const std::string& filePath, const std::vector<uint8_t>& key);
+
+    /// Size and times of a file, read from its header without decrypting its contents. Files
+    /// written before the header recorded them fall back to decryption and the file system.
+    /// A file that cannot be read is reported rather than ending the process.
+    /// \return False if the file could not be opened or failed verification
+    static bool statFile(const std::string& filePath, const std::vector<uint8_t>& key, FileInfo& info);
+
+    /// Decrypt filePath into output, holding a few batches of chunks in memory at a time. The
+    /// records of the batches ahead are read through AsyncIo while earlier ones are decrypted.
+    static void decryptStream(const std::string& filePath, const std::vector<uint8_t>& key, std::ostream& output);
+
+    /// Decrypt part of a file, decrypting only the chunks that overlap it; a compressed file,
+    /// under Compression::kMaxSize bytes, is decrypted whole
+    /// \param offset   First plaintext byte to return
+    /// \param length   Maximum number of bytes to return
+    /// \return The requested bytes, cut short at the end of the file
+    static std::string readRange(const std::string& filePath, uint64_t offset, uint64_t length, const std::vector<uint8_t>& key);
+
+    /// Give another user access to an encrypted file without re-encrypting its contents
+    /// \param sourcePath     The shared file
+    /// \param ownerKey       Key of the file's owner
+    /// \param linkPath       Where to create the recipient's link to the file
+    /// \param recipientKey   Key of the recipient
+    static void shareFile(const std::string& sourcePath, const std::vector<uint8_t>& ownerKey, const std::string& linkPath, const std::vector<uint8_t>& recipientKey);
+
+    /// Share a file with several users at once; the file's data key is recovered once and
+    /// the links are written in parallel
+    /// \param sourcePath   The shared file
+    /// \param ownerKey     Key of the file's owner
+    /// \param targets      Link path and key of every recipient
+    static void shareFile(const std::string& sourcePath, const std::vector<uint8_t>& ownerKey, const std::vector<ShareTarget>& targets);
+
 private:
+    static constexpr size_t kMaxBatchBytes = 8 * 1024 * 1024;
+    // Batches whose records are read at once while a scan decrypts the first of them
+    static constexpr size_t kScanBatches = 3;
+    static constexpr size_t kLegacyIvLength = 12;
+    // Contents this large are never compressed, so the file they replace is stored
+    // uncompressed too unless an older version compressed it.
+    static constexpr size_t kMinDeltaSize = Compression::kMaxSize;
+
     static void handleErrors(const std::string& message);
-    static void initCipherContext(EVP_CIPHER_CTX*& ctx, const std::vector<uint8_t>& key, const uint8_t* iv, bool encrypt);
+
+    template <typename Source>
+    static void writeChunked(const std::string& filePath, const std::vector<uint8_t>& key, uint8_t flags, uint64_t plaintextSize, uint64_t storedSize, Source&& source);
+    static bool rewriteChanged(const std::string& filePath, const std::string& content, const std::vector<uint8_t>& key);
+    static bool appendInPlace(const std::string& filePath, const std::string& content, const std::vector<uint8_t>& key);
+    static bool mapForUpdate(const std::string& filePath, const std::vector<uint8_t>& key, MappedFile& file, ChunkedFileHeader& header, ChunkLayout& layout, std::vector<uint8_t>& dataKey, FileMetadata& metadata, std::vector<uint8_t>& fingerprintKey);
+    static size_t parallelBatchChunks(const ChunkedFileHeader& header);
+    template <typename Chunk>
+    static bool processBatch(CipherSuite suite, const std::vector<uint8_t>& key, bool encrypt, size_t count, Chunk&& chunk);
+    static bool sealChunk(EVP_CIPHER_CTX* ctx, const ChunkedFileHeader& header, const std::vector<uint8_t>& fingerprintKey, uint64_t index, bool last, unsigned char* data, size_t length);
+    static bool fingerprintChunk(const ChunkedFileHeader& header, const std::vector<uint8_t>& fingerprintKey, const uint8_t* nonce, const unsigned char* plaintext, size_t length, uint8_t* fingerprint);
+    static std::vector<uint8_t> chunkFingerprintKey(const std::vector<uint8_t>& dataKey);
+    static bool openChunk(EVP_CIPHER_CTX* ctx, const ChunkedFileHeader& header, uint64_t index, bool last, const unsigned char* record, size_t length, unsigned char* plaintext);
+    static bool sealMetadata(const std::vector<uint8_t>& dataKey, const ChunkedFileHeader& header, FileMetadata& metadata);
+    static bool openMetadata(const std::vector<uint8_t>& dataKey, const ChunkedFileHeader& header, const FileMetadata& metadata);
+    static int64_t currentTimeNs();
+
+    static bool wrapKey(const std::vector<uint8_t>& key, const std::vector<uint8_t>& dataKey, uint8_t* wrapped);
+    static bool unwrapKey(const std::vector<uint8_t>& key, const uint8_t* wrapped, std::vector<uint8_t>& dataKey);
+    static bool readDataKey(const std::string& filePath, const std::vector<uint8_t>& key, std::vector<uint8_t>& dataKey, int64_t* createdNs = nullptr);
+    static const char* writeLink(const fs::path& source, const std::vector<uint8_t>& dataKey, const ShareTarget& target);
+
+    static bool mapForDecryption(const std::string& filePath, const std::vector<uint8_t>& key, int advice, MappedFile& file, ChunkedFileHeader& header, ChunkLayout& layout, std::vector<uint8_t>& dataKey, FileMetadata& metadata);
+    static const char* mapContents(const std::string& filePath, const std::vector<uint8_t>& key, int advice, MappedFile& file, ChunkedFileHeader& header, ChunkLayout& layout, std::vector<uint8_t>& dataKey, FileMetadata& metadata, bool& chunked, bool* linkedOut = nullptr);
+    static const char* readFileInfo(const std::string& filePath, const std::vector<uint8_t>& key, FileInfo& info);
+    static std::string openChunks(const MappedFile& file, const ChunkedFileHeader& header, const ChunkLayout& layout, const std::vector<uint8_t>& dataKey, const FileMetadata& metadata);
+    static bool addChunkTags(ChunkDigest& digest, const MappedFile& file, const ChunkedFileHeader& header, const ChunkLayout& layout, uint64_t first, uint64_t count);
+    static bool readChunkTags(AsyncIo& io, ChunkDigest& digest, const MappedFile& file, const ChunkedFileHeader& header, const ChunkLayout& layout, uint64_t first, uint64_t count);
+    static unsigned scanDepth(const ChunkedFileHeader& header, uint64_t chunks);
+    template <typename Sink>
+    static const char* scanChunks(AsyncIo& io, const MappedFile& file, const ChunkedFileHeader& header, const ChunkLayout& layout, const std::vector<uint8_t>& dataKey, uint64_t first, uint64_t count, ChunkDigest* digest, Sink&& sink);
+    static std::string decryptLegacy(const MappedFile& file, const std::vector<uint8_t>& key);
+    static const char* openLegacy(const MappedFile& file, const std::vector<uint8_t>& key, std::string& plaintext);
 };
 
 void Encryption::handleErrors(const std::string& message) {
@@ -35,107 +156,1192 @@ void Encryption::handleErrors(const std::string& message) {
     exit(EXIT_FAILURE); // It's more conventional to exit with a failure status on error.
 }
 
-void Encryption::initCipherContext(EVP_CIPHER_CTX*& ctx, const std::vector<uint8_t>& key, const uint8_t* iv, bool encrypt) {
-    ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) {
-        handleErrors("Cipher context initialization failed.");
+void Encryption::encryptFile(const std::string& filePath, const std::string& content, const std::vector<uint8_t>& key) {
+    if (content.size() >= kMinDeltaSize && rewriteChanged(filePath, content, key)) {
+        return;
+    }
+    std::string compressed;
+    bool compress = Compression::compress(content, compressed);
+    const std::string& stored = compress ? compressed : content;
+
+    size_t position = 0;
+    uint8_t flags = compress ? ChunkFormat::kFlagCompressed : 0;
+    writeChunked(filePath, key, flags, content.size(), stored.size(), [&](unsigned char* buffer, size_t capacity) {
+        size_t length = std::min(capacity, stored.size() - position);
+        std::memcpy(buffer, stored.data() + position, length);
+        position += length;
+        return length;
+    });
+}
+
+// The file is read one chunk-sized block at a time, two batches ahead of sealing. Its size is
+// taken when the import starts; a file that ends sooner fails, and one that grows is cut off.
+void Encryption::encryptStream(const PosixFile& input, const std::string& filePath, const std::vector<uint8_t>& key) {
+    uint64_t size = 0;
+    if (!input.size(size)) {
+        handleErrors("Failed to read input file.");
+    }
+    ChunkedFileHeader header = ChunkFormat::newHeader(CipherSuites::preferred());
+    size_t blocks = 2 * parallelBatchChunks(header);
+    AsyncIo io(scanDepth(header, size / header.chunk_size + 1));
+    AsyncReader reader(io, input.descriptor(), size, header.chunk_size, blocks);
+    writeChunked(filePath, key, 0, size, size, [&](unsigned char* buffer, size_t capacity) {
+        return reader.read(buffer, capacity);
+    });
+    if (reader.failed()) {
+        handleErrors("Failed to read input file.");
+    }
+}
+
+// source(buffer, capacity) fills buffer and returns how many bytes it wrote; a short count
+// means the input is exhausted. Chunks are read in batches that are sealed in parallel and
+// written in order; reading one chunk past a full batch tells us which chunk is the last.
+// Overwriting a file keeps its data key, so links to it stay valid, and its creation time.
+// The header leads the first batch's buffer, so a file of one batch takes a single write.
+// Larger files alternate between two buffers, writing one through AsyncIo while the next
+// batch is read and sealed into the other, and get their metadata, which covers every
+// chunk's tag, once the last batch is sealed and every write is done. storedSize, the size
+// of what source yields, sizes the buffers.
+template <typename Source>
+void Encryption::writeChunked(const std::string& filePath, const std::vector<uint8_t>& key, uint8_t flags, uint64_t plaintextSize, uint64_t storedSize, Source&& source) {
+    ChunkedFileHeader header = ChunkFormat::newHeader(CipherSuites::preferred());
+    header.flags = flags;
+    if (key.size() != KEY_SIZE) {
+        handleErrors("Encryption initialization failed.");
+    }
+    FileMetadata metadata{};
+    metadata.created_ns = metadata.modified_ns = currentTimeNs();
+    std::vector<uint8_t> dataKey;
+    KeyWipe wipeDataKey(dataKey);
+    if (!readDataKey(filePath, key, dataKey, &metadata.created_ns)) {
+        dataKey.resize(KEY_SIZE);
+        RAND_bytes(dataKey.data(), KEY_SIZE);
+    }
+    uint8_t wrappedKey[WRAPPED_KEY_SIZE];
+    ChunkDigest digest(dataKey);
+    std::vector<uint8_t> fingerprintKey = chunkFingerprintKey(dataKey);
+    KeyWipe wipeFingerprintKey(fingerprintKey);
+    if (!wrapKey(key, dataKey, wrappedKey) || !digest.isReady() || fingerprintKey.empty()) {
+        handleErrors("Encryption failed.");
     }
 
-    if (encrypt) {
-        if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key.data(), iv)) {
-            handleErrors("Encryption initialization failed.");
+    PosixFile outputFile;
+    if (!outputFile.openForWrite(filePath)) {
+        handleErrors("Failed to open output file.");
+    }
+    bool written = true;
+
+    size_t overhead = ChunkFormat::recordOverhead(header);
+    size_t recordSize = header.chunk_size + overhead;
+    size_t batchChunks = parallelBatchChunks(header);
+    batchChunks = static_cast<size_t>(std::min<uint64_t>(batchChunks, storedSize / header.chunk_size + 1));
+    std::vector<unsigned char> buffers[2], lookahead;
+    std::vector<unsigned char>& buffer = buffers[0];
+    buffer.resize(header.header_size + batchChunks * recordSize);
+    std::vector<size_t> lengths(batchChunks);
+    std::memcpy(buffer.data(), &header, sizeof(header));
+    std::memcpy(buffer.data() + sizeof(header), wrappedKey, WRAPPED_KEY_SIZE);
+    std::unique_ptr<AsyncIo> io;
+    AsyncIo::Ticket writes[2];
+    bool pending[2] = {false, false};
+    size_t current = 0;
+
+    auto finishMetadata = [&](uint8_t* block) {
+        metadata.plaintext_size = plaintextSize;
+        std::memcpy(metadata.chunk_digest, digest.value(), CHUNK_DIGEST_SIZE);
+        if (!sealMetadata(dataKey, header, metadata)) {
+            handleErrors("Encryption failed.");
         }
-    } else {
-        if (1 != EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key.data(), iv)) {
-            handleErrors("Decryption initialization failed.");
+        ChunkFormat::writeMetadata(header, metadata, block);
+    };
+
+    size_t count = 1;
+    uint64_t offset = 0;
+    unsigned char* batch = buffer.data() + header.header_size;
+    lengths[0] = source(batch, header.chunk_size);
+    uint64_t base = 0;
+    for (;;) {
+        bool last = false;
+        size_t lookaheadLength = 0;
+        while (!last) {
+            if (lengths[count - 1] < header.chunk_size) {
+                last = true;
+            } else if (count == batchChunks) {
+                lookahead.resize(header.chunk_size);
+                lookaheadLength = source(lookahead.data(), header.chunk_size);
+                last = lookaheadLength == 0;
+                break;
+            } else if ((lengths[count] = source(batch + count * recordSize, header.chunk_size)) == 0) {
+                last = true;
+            } else {
+                ++count;
+            }
+        }
+
+        bool sealed = processBatch(ChunkFormat::suiteOf(header), dataKey, true, count, [&](EVP_CIPHER_CTX* ctx, size_t i) {
+            return sealChunk(ctx, header, fingerprintKey, base + i, last && i + 1 == count, batch + i * recordSize, lengths[i]);
+        });
+        for (size_t i = 0; sealed && i < count; ++i) {
+            sealed = digest.toggle(base + i, batch + i * recordSize + lengths[i]);
+        }
+        if (!sealed) {
+            handleErrors("Encryption failed.");
+        }
+        // Only the file's last chunk can be short, so a batch's records are contiguous.
+        size_t batchBytes = (count - 1) * recordSize + lengths[count - 1] + overhead;
+        unsigned char* start = batch;
+        if (base == 0) {
+            start = buffer.data();
+            batchBytes += header.header_size;
+            if (last) {
+                finishMetadata(start + ChunkFormat::kMetadataOffset);
+            }
+        }
+        if (io) {
+            writes[current] = io->write(outputFile.descriptor(), start, batchBytes, offset);
+            pending[current] = true;
+        } else {
+            written = written && outputFile.writeAt(start, batchBytes, offset);
+        }
+        offset += batchBytes;
+        if (last) {
+            break;
+        }
+
+        // The other buffer is free once the write from it two batches back is done.
+        size_t next = current ^ 1;
+        if (!io) {
+            io = std::make_unique<AsyncIo>(2);
+            buffers[next].resize(buffer.size());
+        }
+        if (pending[next]) {
+            written = io->wait(writes[next]) && written;
+            pending[next] = false;
         }
+        current = next;
+        batch = buffers[current].data() + header.header_size;
+        base += count;
+        std::memcpy(batch, lookahead.data(), lookaheadLength);
+        lengths[0] = lookaheadLength;
+        count = 1;
     }
 
-    if (1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, IV_SIZE, nullptr)) {
-        handleErrors("Failed to set IV length.");
+    if (io) {
+        written = io->drain() && written;
+    }
+    if (base != 0) {
+        uint8_t block[sizeof(FileMetadata)];
+        finishMetadata(block);
+        written = written && outputFile.writeAt(block, ChunkFormat::metadataSize(header), ChunkFormat::kMetadataOffset);
+    }
+    if (!outputFile.close() || !written) {
+        handleErrors("Failed to write output file.");
     }
 }
 
-void Encryption::encryptFile(const std::string& filePath, const std::string& content, const std::vector<uint8_t>& key) {
-    uint8_t iv[IV_SIZE];
-    RAND_bytes(iv, sizeof(iv));
-    unsigned char tag[TAG_SIZE];
-    EVP_CIPHER_CTX* ctx;
+// Rewrites in place only the chunks of filePath whose contents differ from content, then its
+// metadata. New contents are compared with each chunk's fingerprint, so old chunks are
+// neither decrypted nor read beyond their trailers; changed ones are resealed under fresh
+// nonces, and the chunk digest is rebuilt from the tags the file ends up with. A chunk is
+// kept only where it has the same length and last flag as before.
+// Chunks past the old end of the file are written and synced first, so a crash then leaves
+// the old contents behind a torn tail; a failed write truncates the file back to its old
+// end. Changed chunks inside the old file and the new metadata then go to an update journal,
+// which is synced before any of them overwrites the file, so a crash leaves either version
+// readable (see update_journal.h).
+// \return False, having written nothing, if the file is not an uncompressed file of the
+// current version under key and the preferred suite, or if more than half of its chunks
+// change: a whole rewrite then costs about the same. A large file that older code stored
+// compressed is rewritten whole once, uncompressed, and in place after that.
+bool Encryption::rewriteChanged(const std::string& filePath, const std::string& content, const std::vector<uint8_t>& key) {
+    MappedFile file;
+    ChunkedFileHeader header{};
+    ChunkLayout layout{};
+    FileMetadata metadata{};
+    std::vector<uint8_t> dataKey, fingerprintKey;
+    KeyWipe wipeDataKey(dataKey), wipeFingerprintKey(fingerprintKey);
+    if (!mapForUpdate(filePath, key, file, header, layout, dataKey, metadata, fingerprintKey) ||
+        ChunkFormat::suiteOf(header) != CipherSuites::preferred()) {
+        return false;
+    }
 
-    initCipherContext(ctx, key, iv, true);
+    CipherSuite suite = ChunkFormat::suiteOf(header);
+    uint64_t chunkCount = content.empty() ? 1 : (content.size() + header.chunk_size - 1) / header.chunk_size;
+    auto chunkLength = [&](uint64_t index) {
+        return static_cast<size_t>(std::min<uint64_t>(header.chunk_size, content.size() - index * header.chunk_size));
+    };
+    std::vector<uint8_t> tags(chunkCount * TAG_SIZE);
+    std::vector<char> kept(chunkCount, 0);
 
-    std::ofstream outputFile(filePath, std::ios::binary);
-    if (!outputFile.is_open()) {
+    file.advise(MADV_RANDOM);
+    uint64_t comparable = std::min(chunkCount, layout.chunk_count);
+    ThreadPool::shared().parallelFor(comparable, [&](size_t index) {
+        bool last = index + 1 == chunkCount;
+        if (last != (index + 1 == layout.chunk_count) || layout.recordSize(header, index) - layout.record_overhead != chunkLength(index)) {
+            return;
+        }
+        const uint8_t* trailer = file.data() + layout.tagOffset(header, index) + TAG_SIZE;
+        uint8_t nonce[CHUNK_NONCE_SIZE], fingerprint[CHUNK_FINGERPRINT_SIZE];
+        ChunkFormat::chunkNonce(header, index, trailer, nonce);
+        kept[index] = fingerprintChunk(header, fingerprintKey, nonce, reinterpret_cast<const unsigned char*>(content.data()) + index * header.chunk_size,
+                                       chunkLength(index), fingerprint) &&
+                      CRYPTO_memcmp(fingerprint, trailer + CHUNK_NONCE_SIZE, CHUNK_FINGERPRINT_SIZE) == 0;
+    });
+    uint64_t keptCount = 0;
+    for (uint64_t index = 0; index < comparable; ++index) {
+        if (kept[index]) {
+            std::memcpy(&tags[index * TAG_SIZE], file.data() + layout.tagOffset(header, index), TAG_SIZE);
+            ++keptCount;
+        }
+    }
+    if ((chunkCount - keptCount) * 2 > chunkCount) {
+        return false;
+    }
+    uint8_t oldBlock[sizeof(FileMetadata)];
+    std::memcpy(oldBlock, file.data() + ChunkFormat::kMetadataOffset, ChunkFormat::metadataSize(header));
+    file.close();
+
+    PosixFile output;
+    UpdateJournal journal;
+    if (!output.openForUpdate(filePath)) {
         handleErrors("Failed to open output file.");
     }
+    size_t batchChunks = parallelBatchChunks(header);
+    size_t recordSize = header.chunk_size + layout.record_overhead;
+    uint64_t oldEnd = layout.recordOffset(header, layout.chunk_count - 1) + layout.last_record_size;
+    auto recordEnd = [&](uint64_t index) {
+        return layout.recordOffset(header, index) + chunkLength(index) + layout.record_overhead;
+    };
+    // Chunks from grown on reach past the old end of the file, so none of them is kept.
+    uint64_t grown = std::min<uint64_t>(chunkCount - 1, (oldEnd - header.header_size) / recordSize);
+    if (recordEnd(grown) <= oldEnd) {
+        ++grown;
+    }
+    std::vector<unsigned char> batch, head;
+    // Seals the changed chunks in [begin, end) and writes them, to the journal if journaled,
+    // holding back the part of chunk grown that overwrites the old file.
+    auto writeChanged = [&](uint64_t begin, uint64_t end, bool journaled) {
+        bool written = true;
+        for (uint64_t first = begin; first < end;) {
+            if (kept[first]) {
+                ++first;
+                continue;
+            }
+            size_t count = 1;
+            while (count < batchChunks && first + count < end && !kept[first + count]) {
+                ++count;
+            }
+            batch.resize(count * recordSize);
+            bool sealed = processBatch(suite, dataKey, true, count, [&](EVP_CIPHER_CTX* ctx, size_t i) {
+                uint64_t index = first + i;
+                unsigned char* record = batch.data() + i * recordSize;
+                std::memcpy(record, content.data() + index * header.chunk_size, chunkLength(index));
+                return sealChunk(ctx, header, fingerprintKey, index, index + 1 == chunkCount, record, chunkLength(index));
+            });
+            if (!sealed) {
+                handleErrors("Encryption failed.");
+            }
+            for (size_t i = 0; i < count; ++i) {
+                std::memcpy(&tags[(first + i) * TAG_SIZE], batch.data() + i * recordSize + chunkLength(first + i), TAG_SIZE);
+            }
+            uint64_t runOffset = layout.recordOffset(header, first);
+            size_t runBytes = (count - 1) * recordSize + chunkLength(first + count - 1) + layout.record_overhead;
+            size_t skip = 0;
+            if (first == grown) {
+                skip = static_cast<size_t>(oldEnd - runOffset);
+                head.assign(batch.begin(), batch.begin() + skip);
+            }
+            written = written && (journaled ? journal.add(runOffset + skip, batch.data() + skip, runBytes - skip)
+                                            : output.writeAt(batch.data() + skip, runBytes - skip, runOffset + skip));
+            first += count;
+        }
+        return written;
+    };
+
+    // What lies past the old end reaches the disk before any old record is overwritten.
+    if (grown < chunkCount && (!writeChanged(grown, chunkCount, false) || !output.sync())) {
+        output.truncate(oldEnd);
+        output.close();
+        handleErrors("Failed to write output file.");
+    }
+    bool written = journal.begin(filePath) && writeChanged(0, grown, true) &&
+                   (head.empty() || journal.add(layout.recordOffset(header, grown), head.data(), head.size()));
+
+    ChunkDigest digest(dataKey);
+    bool digested = digest.isReady();
+    for (uint64_t index = 0; digested && index < chunkCount; ++index) {
+        digested = digest.toggle(index, &tags[index * TAG_SIZE]);
+    }
+    metadata.plaintext_size = content.size();
+    metadata.modified_ns = currentTimeNs();
+    std::memcpy(metadata.chunk_digest, digest.value(), CHUNK_DIGEST_SIZE);
+    if (!digested || !sealMetadata(dataKey, header, metadata)) {
+        handleErrors("Encryption failed.");
+    }
+    uint8_t block[sizeof(FileMetadata)];
+    ChunkFormat::writeMetadata(header, metadata, block);
+    size_t blockSize = ChunkFormat::metadataSize(header);
+    written = written && journal.add(ChunkFormat::kMetadataOffset, block, blockSize) &&
+              journal.commit(ChunkFormat::kMetadataOffset, oldBlock, blockSize, recordEnd(chunkCount - 1));
+    if (!written) {
+        journal.discard();
+        output.truncate(oldEnd);
+        output.close();
+        handleErrors("Failed to write output file.");
+    }
+    // Once committed, an update that fails here is finished by the next open of the file.
+    if (!journal.apply(output) || !output.close()) {
+        handleErrors("Failed to write output file.");
+    }
+    return true;
+}
+
+void Encryption::appendFile(const std::string& filePath, const std::string& content, const std::vector<uint8_t>& key) {
+    if (content.empty() || appendInPlace(filePath, content, key)) {
+        return;
+    }
+    encryptFile(filePath, decryptFile(filePath, key) + content, key);
+}
 
-    std::vector<unsigned char> buffer(content.begin(), content.end());
-    buffer.resize(buffer.size() + BLOCK_SIZE); // Ensure space for padding
-    int len = 0, ciphertextLen = 0;
+// Seals content onto the end of filePath in place. The last chunk is decrypted and sealed
+// again followed by the start of content, since it is no longer last and may have room
+// left; the chunks after it hold content alone. The chunk digest is updated with the old
+// last tag and the new ones, so no other chunk is read.
+// Everything past the old end of the file is written and synced before the old last record
+// and the metadata are touched, so a crash before then leaves the old contents and a torn
+// tail that readers ignore; a failed write truncates the file back to its old end. The old
+// last record and the metadata are then replaced together through an update journal.
+// \return False, having written nothing, if the file is not an uncompressed file of the
+// current version under key
+bool Encryption::appendInPlace(const std::string& filePath, const std::string& content, const std::vector<uint8_t>& key) {
+    MappedFile file;
+    ChunkedFileHeader header{};
+    ChunkLayout layout{};
+    FileMetadata metadata{};
+    std::vector<uint8_t> dataKey, fingerprintKey;
+    KeyWipe wipeDataKey(dataKey), wipeFingerprintKey(fingerprintKey);
+    if (!mapForUpdate(filePath, key, file, header, layout, dataKey, metadata, fingerprintKey)) {
+        return false;
+    }
+
+    CipherSuite suite = ChunkFormat::suiteOf(header);
+    uint64_t first = layout.chunk_count - 1;
+    size_t lastLength = layout.recordSize(header, first) - layout.record_overhead;
+    uint64_t tailSize = lastLength + content.size();
+    uint64_t chunkCount = first + (tailSize + header.chunk_size - 1) / header.chunk_size;
+    auto chunkLength = [&](uint64_t index) {
+        return static_cast<size_t>(std::min<uint64_t>(header.chunk_size, tailSize - (index - first) * header.chunk_size));
+    };
+
+    size_t batchChunks = parallelBatchChunks(header);
+    size_t recordSize = header.chunk_size + layout.record_overhead;
+    std::vector<unsigned char> batch(std::min<uint64_t>(batchChunks, chunkCount - first) * recordSize);
+    const unsigned char* lastRecord = file.data() + layout.recordOffset(header, first);
+    ChunkDigest digest(dataKey, metadata.chunk_digest);
+    bool opened = processBatch(suite, dataKey, false, 1, [&](EVP_CIPHER_CTX* ctx, size_t) {
+        return openChunk(ctx, header, first, true, lastRecord, lastLength + layout.record_overhead, batch.data());
+    });
+    if (!opened || !digest.isReady() || !digest.toggle(first, lastRecord + lastLength)) {
+        handleErrors("Tag verification failed.");
+    }
+    uint8_t oldBlock[sizeof(FileMetadata)];
+    std::memcpy(oldBlock, file.data() + ChunkFormat::kMetadataOffset, ChunkFormat::metadataSize(header));
+    file.close();
 
-    if (1 != EVP_EncryptUpdate(ctx, buffer.data(), &len, buffer.data(), buffer.size())) {
+    PosixFile output;
+    if (!output.openForUpdate(filePath)) {
+        handleErrors("Failed to open output file.");
+    }
+    bool written = true;
+    uint64_t offset = layout.recordOffset(header, first);
+    size_t kept = lastLength + layout.record_overhead;
+    uint64_t oldEnd = offset + kept;
+    std::vector<unsigned char> head;
+    for (uint64_t base = first; base < chunkCount;) {
+        size_t count = static_cast<size_t>(std::min<uint64_t>(batchChunks, chunkCount - base));
+        bool sealed = processBatch(suite, dataKey, true, count, [&](EVP_CIPHER_CTX* ctx, size_t i) {
+            uint64_t index = base + i;
+            unsigned char* record = batch.data() + i * recordSize;
+            size_t length = chunkLength(index);
+            if (index == first) {
+                std::memcpy(record + lastLength, content.data(), length - lastLength);
+            } else {
+                std::memcpy(record, content.data() + (index - first) * header.chunk_size - lastLength, length);
+            }
+            return sealChunk(ctx, header, fingerprintKey, index, index + 1 == chunkCount, record, length);
+        });
+        for (size_t i = 0; sealed && i < count; ++i) {
+            sealed = digest.toggle(base + i, batch.data() + i * recordSize + chunkLength(base + i));
+        }
+        if (!sealed) {
+            handleErrors("Encryption failed.");
+        }
+        size_t batchBytes = (count - 1) * recordSize + chunkLength(base + count - 1) + layout.record_overhead;
+        size_t skip = 0;
+        if (base == first) {
+            // The old last record is overwritten only once the new records are on disk.
+            head.assign(batch.begin(), batch.begin() + kept);
+            skip = kept;
+        }
+        written = written && output.writeAt(batch.data() + skip, batchBytes - skip, offset + skip);
+        offset += batchBytes;
+        base += count;
+    }
+    if (!written || !output.sync()) {
+        output.truncate(oldEnd);
+        output.close();
+        handleErrors("Failed to write output file.");
+    }
+
+    metadata.plaintext_size += content.size();
+    metadata.modified_ns = currentTimeNs();
+    std::memcpy(metadata.chunk_digest, digest.value(), CHUNK_DIGEST_SIZE);
+    if (!sealMetadata(dataKey, header, metadata)) {
         handleErrors("Encryption failed.");
     }
-    ciphertextLen += len;
+    uint8_t block[sizeof(FileMetadata)];
+    ChunkFormat::writeMetadata(header, metadata, block);
+    size_t blockSize = ChunkFormat::metadataSize(header);
+    UpdateJournal journal;
+    if (!journal.begin(filePath) || !journal.add(layout.recordOffset(header, first), head.data(), head.size()) ||
+        !journal.add(ChunkFormat::kMetadataOffset, block, blockSize) ||
+        !journal.commit(ChunkFormat::kMetadataOffset, oldBlock, blockSize, offset)) {
+        journal.discard();
+        output.truncate(oldEnd);
+        output.close();
+        handleErrors("Failed to write output file.");
+    }
+    // Once committed, an append that fails here is finished by the next open of the file.
+    if (!journal.apply(output) || !output.close()) {
+        handleErrors("Failed to write output file.");
+    }
+    return true;
+}
 
-    if (1 != EVP_EncryptFinal_ex(ctx, buffer.data() + len, &len)) {
-        handleErrors("Final encryption step failed.");
+// Maps filePath for an in-place update and opens its metadata. The file's records end where
+// the metadata says, so a torn tail left by an interrupted append is ignored and later
+// overwritten or truncated.
+// \return False if filePath is not an uncompressed file of the current version under key
+bool Encryption::mapForUpdate(const std::string& filePath, const std::vector<uint8_t>& key, MappedFile& file, ChunkedFileHeader& header, ChunkLayout& layout, std::vector<uint8_t>& dataKey, FileMetadata& metadata, std::vector<uint8_t>& fingerprintKey) {
+    if (!UpdateJournal::recover(filePath) || !file.open(filePath) || file.size() < ChunkFormat::kMetadataOffset + sizeof(FileMetadata)) {
+        return false;
     }
-    ciphertextLen += len;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (!ChunkFormat::isValidHeader(header) || header.version != ChunkFormat::kVersion || ChunkFormat::isCompressed(header) ||
+        !unwrapKey(key, file.data() + sizeof(header), dataKey)) {
+        return false;
+    }
+    ChunkFormat::readMetadata(header, file.data() + ChunkFormat::kMetadataOffset, metadata);
+    fingerprintKey = chunkFingerprintKey(dataKey);
+    return openMetadata(dataKey, header, metadata) && !fingerprintKey.empty() &&
+           ChunkFormat::layoutOf(header, metadata.plaintext_size, file.size(), layout);
+}
+
+// Enough chunks per batch to keep every thread busy, capped so a batch stays a few MB.
+size_t Encryption::parallelBatchChunks(const ChunkedFileHeader& header) {
+    size_t threads = ThreadPool::shared().concurrency();
+    size_t cap = std::max<size_t>(1, kMaxBatchBytes / header.chunk_size);
+    return std::max<size_t>(1, std::min(threads * 4, cap));
+}
 
-    if (1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_SIZE, tag)) {
-        handleErrors("Failed to get tag.");
+// Runs chunk(ctx, i) for i in [0, count) across the shared worker pool. Each thread keys a
+// context from its own pool, and failures are reported back here instead of exiting from a
+// worker thread.
+template <typename Chunk>
+bool Encryption::processBatch(CipherSuite suite, const std::vector<uint8_t>& key, bool encrypt, size_t count, Chunk&& chunk) {
+    std::atomic<bool> ok{true};
+    ThreadPool::shared().parallelFor(count, [&](size_t i) {
+        if (!ok) {
+            return;
+        }
+        try {
+            CipherContextPool::Lease lease = CipherContextPool::local().acquire(
+                CipherSuites::cipher(suite), key.data(), nullptr, CHUNK_NONCE_SIZE, encrypt);
+            if (!chunk(lease.get(), i)) {
+                ok = false;
+            }
+        } catch (const std::exception&) {
+            ok = false;
+        }
+    });
+    return ok;
+}
+
+// Encrypts length bytes of data in place and appends the tag after them, followed in files
+// that have them by a fresh record nonce and the plaintext's fingerprint.
+bool Encryption::sealChunk(EVP_CIPHER_CTX* ctx, const ChunkedFileHeader& header, const std::vector<uint8_t>& fingerprintKey, uint64_t index, bool last, unsigned char* data, size_t length) {
+    uint8_t nonce[CHUNK_NONCE_SIZE], aad[ChunkFormat::kAadSize];
+    unsigned char* recordNonce = data + length + TAG_SIZE;
+    if (ChunkFormat::hasRecordNonces(header) && 1 != RAND_bytes(recordNonce, CHUNK_NONCE_SIZE)) {
+        return false;
+    }
+    ChunkFormat::chunkNonce(header, index, recordNonce, nonce);
+    if (ChunkFormat::hasRecordNonces(header) &&
+        !fingerprintChunk(header, fingerprintKey, nonce, data, length, recordNonce + CHUNK_NONCE_SIZE)) {
+        return false;
+    }
+    ChunkFormat::chunkAad(header, last, aad);
+
+    int len = 0;
+    return 1 == EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce) &&
+           1 == EVP_EncryptUpdate(ctx, nullptr, &len, aad, sizeof(aad)) &&
+           1 == EVP_EncryptUpdate(ctx, data, &len, data, static_cast<int>(length)) &&
+           1 == EVP_EncryptFinal_ex(ctx, data + len, &len) &&
+           1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_SIZE, data + length);
+}
+
+// Verifies one chunk record of length bytes and decrypts it into plaintext, which receives
+// the record minus its tag and nonce and may be the record itself.
+bool Encryption::openChunk(EVP_CIPHER_CTX* ctx, const ChunkedFileHeader& header, uint64_t index, bool last, const unsigned char* record, size_t length, unsigned char* plaintext) {
+    size_t overhead = ChunkFormat::recordOverhead(header);
+    if (length < overhead) {
+        return false;
+    }
+    size_t ciphertextLength = length - overhead;
+
+    uint8_t nonce[CHUNK_NONCE_SIZE], aad[ChunkFormat::kAadSize];
+    ChunkFormat::chunkNonce(header, index, record + ciphertextLength + TAG_SIZE, nonce);
+    ChunkFormat::chunkAad(header, last, aad);
+
+    int len = 0;
+    return 1 == EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce) &&
+           1 == EVP_DecryptUpdate(ctx, nullptr, &len, aad, sizeof(aad)) &&
+           1 == EVP_DecryptUpdate(ctx, plaintext, &len, record, static_cast<int>(ciphertextLength)) &&
+           1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TAG_SIZE, const_cast<unsigned char*>(record) + ciphertextLength) &&
+           1 == EVP_DecryptFinal_ex(ctx, plaintext + len, &len);
+}
+
+// The fingerprint is the suite's tag over the plaintext as additional data, under the
+// fingerprint key and the chunk's nonce. A nonce is only ever reused with another plaintext
+// to compare it with a stored fingerprint, and such fingerprints are never written.
+bool Encryption::fingerprintChunk(const ChunkedFileHeader& header, const std::vector<uint8_t>& fingerprintKey, const uint8_t* nonce, const unsigned char* plaintext, size_t length, uint8_t* fingerprint) {
+    try {
+        CipherContextPool::Lease lease = CipherContextPool::local().acquire(
+            CipherSuites::cipher(ChunkFormat::suiteOf(header)), fingerprintKey.data(), nonce, CHUNK_NONCE_SIZE, true);
+        unsigned char none[TAG_SIZE];
+        int len = 0;
+        return 1 == EVP_EncryptUpdate(lease.get(), nullptr, &len, plaintext, static_cast<int>(length)) &&
+               1 == EVP_EncryptFinal_ex(lease.get(), none, &len) &&
+               1 == EVP_CIPHER_CTX_ctrl(lease.get(), EVP_CTRL_AEAD_GET_TAG, CHUNK_FINGERPRINT_SIZE, fingerprint);
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Derived so fingerprints, which are computed under reused nonces, never share a key with
+// the chunks themselves.
+std::vector<uint8_t> Encryption::chunkFingerprintKey(const std::vector<uint8_t>& dataKey) {
+    static const char label[] = "EFS chunk fingerprint";
+    std::vector<uint8_t> fingerprintKey(KEY_SIZE);
+    unsigned int length = 0;
+    if (HMAC(EVP_sha256(), dataKey.data(), static_cast<int>(dataKey.size()), reinterpret_cast<const unsigned char*>(label),
+             sizeof(label) - 1, fingerprintKey.data(), &length) == nullptr || length != KEY_SIZE) {
+        OPENSSL_cleanse(fingerprintKey.data(), fingerprintKey.size());
+        fingerprintKey.clear();
+    }
+    return fingerprintKey;
+}
+
+// Authenticates the metadata under a fresh nonce; nothing is encrypted.
+bool Encryption::sealMetadata(const std::vector<uint8_t>& dataKey, const ChunkedFileHeader& header, FileMetadata& metadata) {
+    RAND_bytes(metadata.nonce, CHUNK_NONCE_SIZE);
+    uint8_t aad[ChunkFormat::kMetadataAadSize];
+    size_t aadLength = ChunkFormat::metadataAad(header, metadata, aad);
+    try {
+        CipherContextPool::Lease lease = CipherContextPool::local().acquire(
+            CipherSuites::cipher(ChunkFormat::suiteOf(header)), dataKey.data(), metadata.nonce, CHUNK_NONCE_SIZE, true);
+        unsigned char none[TAG_SIZE];
+        int len = 0;
+        return 1 == EVP_EncryptUpdate(lease.get(), nullptr, &len, aad, static_cast<int>(aadLength)) &&
+               1 == EVP_EncryptFinal_ex(lease.get(), none, &len) &&
+               1 == EVP_CIPHER_CTX_ctrl(lease.get(), EVP_CTRL_AEAD_GET_TAG, TAG_SIZE, metadata.tag);
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+bool Encryption::openMetadata(const std::vector<uint8_t>& dataKey, const ChunkedFileHeader& header, const FileMetadata& metadata) {
+    uint8_t aad[ChunkFormat::kMetadataAadSize], tag[TAG_SIZE];
+    size_t aadLength = ChunkFormat::metadataAad(header, metadata, aad);
+    std::memcpy(tag, metadata.tag, TAG_SIZE);
+    try {
+        CipherContextPool::Lease lease = CipherContextPool::local().acquire(
+            CipherSuites::cipher(ChunkFormat::suiteOf(header)), dataKey.data(), metadata.nonce, CHUNK_NONCE_SIZE, false);
+        unsigned char none[TAG_SIZE];
+        int len = 0;
+        return 1 == EVP_DecryptUpdate(lease.get(), nullptr, &len, aad, static_cast<int>(aadLength)) &&
+               1 == EVP_CIPHER_CTX_ctrl(lease.get(), EVP_CTRL_AEAD_SET_TAG, TAG_SIZE, tag) &&
+               1 == EVP_DecryptFinal_ex(lease.get(), none, &len);
+    } catch (const std::exception&) {
+        return false;
     }
+}
 
-    outputFile.write(reinterpret_cast<char*>(iv), IV_SIZE);
-    outputFile.write(reinterpret_cast<char*>(tag), TAG_SIZE);
-    outputFile.write(reinterpret_cast<char*>(buffer.data()), ciphertextLen);
+int64_t Encryption::currentTimeNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
 
+// AES key wrap (RFC 3394) of a data key under a user key.
+bool Encryption::wrapKey(const std::vector<uint8_t>& key, const std::vector<uint8_t>& dataKey, uint8_t* wrapped) {
+    if (key.size() != KEY_SIZE || dataKey.size() != KEY_SIZE) {
+        return false;
+    }
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return false;
+    }
+    EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+
+    int len = 0, wrappedLen = 0;
+    bool ok = 1 == EVP_EncryptInit_ex(ctx, EVP_aes_256_wrap(), nullptr, key.data(), nullptr) &&
+              1 == EVP_EncryptUpdate(ctx, wrapped, &len, dataKey.data(), KEY_SIZE);
+    wrappedLen = len;
+    ok = ok && 1 == EVP_EncryptFinal_ex(ctx, wrapped + wrappedLen, &len) && wrappedLen + len == WRAPPED_KEY_SIZE;
     EVP_CIPHER_CTX_free(ctx);
-    outputFile.close();
+    return ok;
 }
 
-std::string Encryption::decryptFile(const std::string& filePath, const std::vector<uint8_t>& key) {
-    std::ifstream inputFile(filePath, std::ios::binary);
-    if (!inputFile.is_open()) {
-        handleErrors("Failed to open input file.");
+// Unwrapping with the wrong key fails the key wrap's integrity check.
+bool Encryption::unwrapKey(const std::vector<uint8_t>& key, const uint8_t* wrapped, std::vector<uint8_t>& dataKey) {
+    if (key.size() != KEY_SIZE) {
+        return false;
     }
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return false;
+    }
+    EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
 
-    uint8_t iv[IV_SIZE], tag[TAG_SIZE];
-    inputFile.read(reinterpret_cast<char*>(iv), IV_SIZE);
-    inputFile.read(reinterpret_cast<char*>(tag), TAG_SIZE);
+    // The output needs room for a full block beyond the key until the check passes.
+    dataKey.assign(WRAPPED_KEY_SIZE, 0);
+    int len = 0, keyLen = 0;
+    bool ok = 1 == EVP_DecryptInit_ex(ctx, EVP_aes_256_wrap(), nullptr, key.data(), nullptr) &&
+              1 == EVP_DecryptUpdate(ctx, dataKey.data(), &len, wrapped, WRAPPED_KEY_SIZE);
+    keyLen = len;
+    ok = ok && 1 == EVP_DecryptFinal_ex(ctx, dataKey.data() + keyLen, &len) && keyLen + len == KEY_SIZE;
+    EVP_CIPHER_CTX_free(ctx);
+    size_t kept = ok ? KEY_SIZE : 0;
+    OPENSSL_cleanse(dataKey.data() + kept, dataKey.size() - kept);
+    dataKey.resize(kept);
+    return ok;
+}
+
+// Data key of an existing chunked file, if it has one that key unwraps, and its creation time
+// if it records one. Only the header is read.
+bool Encryption::readDataKey(const std::string& filePath, const std::vector<uint8_t>& key, std::vector<uint8_t>& dataKey, int64_t* createdNs) {
+    PosixFile file;
+    ChunkedFileHeader header{};
+    uint8_t wrappedKey[WRAPPED_KEY_SIZE];
+    if (!UpdateJournal::recover(filePath) || !file.openForRead(filePath) || !file.readAt(&header, sizeof(header), 0)) {
+        return false;
+    }
+    if (!ChunkFormat::isValidHeader(header) || !ChunkFormat::hasDataKey(header) ||
+        !file.readAt(wrappedKey, sizeof(wrappedKey), sizeof(header))) {
+        return false;
+    }
+    if (!unwrapKey(key, wrappedKey, dataKey)) {
+        return false;
+    }
+    FileMetadata metadata{};
+    uint8_t block[sizeof(FileMetadata)];
+    if (createdNs != nullptr && ChunkFormat::hasMetadata(header) &&
+        file.readAt(block, ChunkFormat::metadataSize(header), ChunkFormat::kMetadataOffset)) {
+        ChunkFormat::readMetadata(header, block, metadata);
+        if (openMetadata(dataKey, header, metadata)) {
+            *createdNs = metadata.created_ns;
+        }
+    }
+    return true;
+}
 
-    EVP_CIPHER_CTX* ctx;
-    initCipherContext(ctx, key, iv, false);
+void Encryption::shareFile(const std::string& sourcePath, const std::vector<uint8_t>& ownerKey, const std::string& linkPath, const std::vector<uint8_t>& recipientKey) {
+    shareFile(sourcePath, ownerKey, {ShareTarget{linkPath, recipientKey}});
+}
+
+void Encryption::shareFile(const std::string& sourcePath, const std::vector<uint8_t>& ownerKey, const std::vector<ShareTarget>& targets) {
+    std::vector<uint8_t> dataKey;
+    KeyWipe wipeDataKey(dataKey);
+    if (!readDataKey(sourcePath, ownerKey, dataKey)) {
+        // Files written before data keys existed are rewritten once to get one.
+        encryptFile(sourcePath, decryptFile(sourcePath, ownerKey), ownerKey);
+        if (!readDataKey(sourcePath, ownerKey, dataKey)) {
+            handleErrors("Encryption failed.");
+        }
+    }
 
-    std::vector<unsigned char> buffer((std::istreambuf_iterator<char>(inputFile)), std::istreambuf_iterator<char>());
-    std::vector<unsigned char> decryptedText(buffer.size());
+    fs::path source = fs::absolute(sourcePath);
+    std::atomic<const char*> error{nullptr};
+    ThreadPool::shared().parallelFor(targets.size(), [&](size_t i) {
+        if (const char* failure = writeLink(source, dataKey, targets[i])) {
+            const char* none = nullptr;
+            error.compare_exchange_strong(none, failure);
+        }
+    });
+    if (error) {
+        handleErrors(error.load());
+    }
+}
 
-    int len = 0, plaintextLen = 0;
-    if (1 != EVP_DecryptUpdate(ctx, decryptedText.data(), &len, buffer.data(), buffer.size())) {
-        handleErrors("Decryption failed.");
+// Writes one link file. Runs on worker threads, so failures are returned as the message to
+// report rather than reported here.
+const char* Encryption::writeLink(const fs::path& source, const std::vector<uint8_t>& dataKey, const ShareTarget& target) {
+    LinkFileHeader link{};
+    std::memcpy(link.magic, ChunkFormat::kLinkMagic, sizeof(link.magic));
+    link.version = ChunkFormat::kLinkVersion;
+    std::string relativeTarget = fs::relative(source, fs::absolute(target.linkPath).parent_path()).string();
+    link.target_size = static_cast<uint32_t>(relativeTarget.size());
+    if (!wrapKey(target.recipientKey, dataKey, link.wrapped_key)) {
+        return "Encryption failed.";
     }
-    plaintextLen += len;
 
-    if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, tag)) {
-        handleErrors("Failed to set expected tag.");
+    std::string contents(reinterpret_cast<const char*>(&link), sizeof(link));
+    contents += relativeTarget;
+
+    PosixFile outputFile;
+    if (!outputFile.openForWrite(target.linkPath)) {
+        return "Failed to open output file.";
+    }
+    bool written = outputFile.append(contents.data(), contents.size());
+    return outputFile.close() && written ? nullptr : "Failed to write output file.";
+}
+
+// Maps the file holding filePath's contents, following a link to a shared file, finds the key
+// its chunks are encrypted under and verifies its metadata. Files without a metadata block
+// get the stored size and the file's modification time. advice (MADV_*) says how the
+// contents will be read.
+// \return False for files in the legacy format, which are decrypted with key itself
+bool Encryption::mapForDecryption(const std::string& filePath, const std::vector<uint8_t>& key, int advice, MappedFile& file, ChunkedFileHeader& header, ChunkLayout& layout, std::vector<uint8_t>& dataKey, FileMetadata& metadata) {
+    bool chunked = false;
+    if (const char* error = mapContents(filePath, key, advice, file, header, layout, dataKey, metadata, chunked)) {
+        handleErrors(error);
+    }
+    return chunked;
+}
+
+// mapForDecryption without exiting: chunked is set false for legacy files, and linkedOut, if
+// given, tells whether filePath is a link to a shared file.
+// \return The message to report if the file cannot be read, or null
+const char* Encryption::mapContents(const std::string& filePath, const std::vector<uint8_t>& key, int advice, MappedFile& file, ChunkedFileHeader& header, ChunkLayout& layout, std::vector<uint8_t>& dataKey, FileMetadata& metadata, bool& chunked, bool* linkedOut) {
+    chunked = false;
+    if (!UpdateJournal::recover(filePath)) {
+        return "Failed to finish an interrupted write.";
+    }
+    if (!file.open(filePath)) {
+        return "Failed to open input file.";
+    }
+
+    bool linked = ChunkFormat::isLink(file.data(), file.size());
+    if (linkedOut != nullptr) {
+        *linkedOut = linked;
+    }
+    if (linked) {
+        LinkFileHeader link{};
+        if (file.size() < sizeof(link)) {
+            return "Invalid shared file link.";
+        }
+        std::memcpy(&link, file.data(), sizeof(link));
+        if (link.version != ChunkFormat::kLinkVersion || file.size() - sizeof(link) < link.target_size) {
+            return "Invalid shared file link.";
+        }
+        if (!unwrapKey(key, link.wrapped_key, dataKey)) {
+            return "Tag verification failed.";
+        }
+        fs::path target = fs::path(filePath).parent_path() / std::string(reinterpret_cast<const char*>(file.data()) + sizeof(link), link.target_size);
+        if (!UpdateJournal::recover(target.string())) {
+            return "Failed to finish an interrupted write.";
+        }
+        if (!file.open(target.string())) {
+            return "Failed to open input file.";
+        }
     }
 
-    if (1 != EVP_DecryptFinal_ex(ctx, decryptedText.data() + len, &len)) {
+    file.advise(advice);
+    if (!ChunkFormat::isChunked(file.data(), file.size())) {
+        return linked ? "Invalid encrypted file header." : nullptr;
+    }
+    if (file.size() < sizeof(header)) {
+        return "Invalid encrypted file header.";
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (!ChunkFormat::isValidHeader(header) || (linked && !ChunkFormat::hasDataKey(header))) {
+        return "Invalid encrypted file header.";
+    }
+    // Uncompressed files with metadata are sized by it, past any torn tail.
+    bool sizedByMetadata = ChunkFormat::hasMetadata(header) && !ChunkFormat::isCompressed(header);
+    if (sizedByMetadata ? file.size() < header.header_size : !ChunkFormat::layout(header, file.size(), layout)) {
+        return "Tag verification failed.";
+    }
+
+    if (!linked) {
+        if (!ChunkFormat::hasDataKey(header)) {
+            dataKey = key;
+        } else if (!unwrapKey(key, file.data() + sizeof(header), dataKey)) {
+            return "Tag verification failed.";
+        }
+    }
+
+    if (ChunkFormat::hasMetadata(header)) {
+        ChunkFormat::readMetadata(header, file.data() + ChunkFormat::kMetadataOffset, metadata);
+        if (!openMetadata(dataKey, header, metadata) ||
+            (sizedByMetadata && !ChunkFormat::layoutOf(header, metadata.plaintext_size, file.size(), layout))) {
+            return "Tag verification failed.";
+        }
+    } else {
+        metadata = FileMetadata{};
+        metadata.plaintext_size = layout.plaintext_size;
+        metadata.created_ns = metadata.modified_ns = file.modifiedNs();
+    }
+    chunked = true;
+    return nullptr;
+}
+
+bool Encryption::statFile(const std::string& filePath, const std::vector<uint8_t>& key, FileInfo& info) {
+    return readFileInfo(filePath, key, info) == nullptr;
+}
+
+// Only the header is read, except for compressed files written before it recorded their
+// size, whose first chunk holds it.
+const char* Encryption::readFileInfo(const std::string& filePath, const std::vector<uint8_t>& key, FileInfo& info) {
+    MappedFile file;
+    ChunkedFileHeader header{};
+    ChunkLayout layout{};
+    std::vector<uint8_t> dataKey;
+    KeyWipe wipeDataKey(dataKey);
+    FileMetadata metadata{};
+    info = FileInfo{};
+    bool chunked = false;
+    if (const char* error = mapContents(filePath, key, MADV_RANDOM, file, header, layout, dataKey, metadata, chunked, &info.linked)) {
+        return error;
+    }
+    if (!chunked) {
+        std::string plaintext;
+        if (const char* error = openLegacy(file, key, plaintext)) {
+            return error;
+        }
+        info.size = plaintext.size();
+        info.created_ns = info.modified_ns = file.modifiedNs();
+        info.suite = CipherSuite::Aes256Gcm;
+        return nullptr;
+    }
+
+    info.size = metadata.plaintext_size;
+    info.created_ns = metadata.created_ns;
+    info.modified_ns = metadata.modified_ns;
+    info.suite = ChunkFormat::suiteOf(header);
+    info.chunk_size = header.chunk_size;
+    info.compressed = ChunkFormat::isCompressed(header);
+    if (info.compressed && !ChunkFormat::hasMetadata(header)) {
+        std::vector<unsigned char> first(layout.recordSize(header, 0));
+        bool opened = processBatch(info.suite, dataKey, false, 1, [&](EVP_CIPHER_CTX* ctx, size_t) {
+            return openChunk(ctx, header, 0, layout.chunk_count == 1, file.data() + layout.recordOffset(header, 0), first.size(), first.data());
+        });
+        if (!opened || first.size() < layout.record_overhead + Compression::kSizePrefix) {
+            return "Tag verification failed.";
+        }
+        std::memcpy(&info.size, first.data(), Compression::kSizePrefix);
+    }
+    return nullptr;
+}
+
+std::string Encryption::decryptFile(const std::string& filePath, const std::vector<uint8_t>& key) {
+    MappedFile file;
+    ChunkedFileHeader header{};
+    ChunkLayout layout{};
+    std::vector<uint8_t> dataKey;
+    KeyWipe wipeDataKey(dataKey);
+    FileMetadata metadata{};
+    if (!mapForDecryption(filePath, key, MADV_WILLNEED, file, header, layout, dataKey, metadata)) {
+        return decryptLegacy(file, key);
+    }
+
+    std::string stored = openChunks(file, header, layout, dataKey, metadata);
+    if (!ChunkFormat::isCompressed(header)) {
+        return stored;
+    }
+    std::string plaintext;
+    if (!Compression::decompress(reinterpret_cast<const unsigned char*>(stored.data()), stored.size(), plaintext)) {
+        handleErrors("Decompression failed.");
+    }
+    return plaintext;
+}
+
+// Chunks are decrypted from the mapping straight into the returned string.
+std::string Encryption::openChunks(const MappedFile& file, const ChunkedFileHeader& header, const ChunkLayout& layout, const std::vector<uint8_t>& dataKey, const FileMetadata& metadata) {
+    std::string stored(layout.plaintext_size, '\0');
+    bool opened = processBatch(ChunkFormat::suiteOf(header), dataKey, false, layout.chunk_count, [&](EVP_CIPHER_CTX* ctx, size_t i) {
+        return openChunk(ctx, header, i, i + 1 == layout.chunk_count, file.data() + layout.recordOffset(header, i),
+                         layout.recordSize(header, i), reinterpret_cast<unsigned char*>(&stored[i * header.chunk_size]));
+    });
+    if (opened && ChunkFormat::hasChunkDigest(header)) {
+        ChunkDigest digest(dataKey);
+        opened = addChunkTags(digest, file, header, layout, 0, layout.chunk_count) && digest.matches(metadata.chunk_digest);
+    }
+    if (!opened) {
         handleErrors("Tag verification failed.");
     }
-    plaintextLen += len;
+    return stored;
+}
 
-    EVP_CIPHER_CTX_free(ctx);
+bool Encryption::addChunkTags(ChunkDigest& digest, const MappedFile& file, const ChunkedFileHeader& header, const ChunkLayout& layout, uint64_t first, uint64_t count) {
+    for (uint64_t index = first; index < first + count; ++index) {
+        if (!digest.toggle(index, file.data() + layout.tagOffset(header, index))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Depth of the AsyncIo for a scan of chunks records: a scan that fits in one batch reads
+// synchronously, which costs less than setting up a ring.
+unsigned Encryption::scanDepth(const ChunkedFileHeader& header, uint64_t chunks) {
+    return chunks > parallelBatchChunks(header) ? AsyncIo::kDefaultDepth : 0;
+}
+
+// Decrypts chunks [first, first + count) a batch at a time and hands each batch's plaintext
+// to sink(base, count, plaintext). Every record is read on its own through io, and the
+// records of the next kScanBatches - 1 batches stay in flight while a batch is decrypted.
+// Each record's tag goes into digest, if given, once its chunk verifies.
+// \return The message to report if a record cannot be read or fails verification, or null
+template <typename Sink>
+const char* Encryption::scanChunks(AsyncIo& io, const MappedFile& file, const ChunkedFileHeader& header, const ChunkLayout& layout, const std::vector<uint8_t>& dataKey, uint64_t first, uint64_t count, ChunkDigest* digest, Sink&& sink) {
+    size_t batchChunks = parallelBatchChunks(header);
+    uint64_t batches = (count + batchChunks - 1) / batchChunks;
+    size_t slots = static_cast<size_t>(std::min<uint64_t>(batches, kScanBatches));
+    size_t recordSize = header.chunk_size + layout.record_overhead;
+    std::vector<std::vector<unsigned char>> records(slots, std::vector<unsigned char>(batchChunks * recordSize));
+    std::vector<std::vector<AsyncIo::Ticket>> tickets(slots);
+    std::vector<unsigned char> plaintext(batchChunks * header.chunk_size);
+
+    auto chunksIn = [&](uint64_t batch) {
+        return static_cast<size_t>(std::min<uint64_t>(batchChunks, count - batch * batchChunks));
+    };
+    auto queue = [&](uint64_t batch) {
+        size_t slot = static_cast<size_t>(batch % slots);
+        uint64_t base = first + batch * batchChunks;
+        tickets[slot].clear();
+        for (size_t i = 0; i < chunksIn(batch); ++i) {
+            tickets[slot].push_back(io.read(file.descriptor(), records[slot].data() + i * recordSize,
+                                            layout.recordSize(header, base + i), layout.recordOffset(header, base + i)));
+        }
+    };
+    // Reads still in flight target the buffers above, so they are waited for before leaving.
+    auto fail = [&](const char* error) {
+        io.drain();
+        return error;
+    };
+
+    for (uint64_t batch = 0; batch < slots; ++batch) {
+        queue(batch);
+    }
+    for (uint64_t batch = 0; batch < batches; ++batch) {
+        size_t slot = static_cast<size_t>(batch % slots);
+        uint64_t base = first + batch * batchChunks;
+        size_t chunks = chunksIn(batch);
+        bool read = true;
+        for (AsyncIo::Ticket ticket : tickets[slot]) {
+            read = io.wait(ticket) && read;
+        }
+        if (!read) {
+            return fail("Failed to read input file.");
+        }
+        const unsigned char* batchRecords = records[slot].data();
+        bool opened = processBatch(ChunkFormat::suiteOf(header), dataKey, false, chunks, [&](EVP_CIPHER_CTX* ctx, size_t i) {
+            uint64_t index = base + i;
+            return openChunk(ctx, header, index, index + 1 == layout.chunk_count, batchRecords + i * recordSize,
+                             layout.recordSize(header, index), plaintext.data() + i * header.chunk_size);
+        });
+        for (size_t i = 0; opened && digest != nullptr && i < chunks; ++i) {
+            opened = digest->toggle(base + i, batchRecords + i * recordSize + layout.recordSize(header, base + i) - layout.record_overhead);
+        }
+        if (!opened) {
+            return fail("Tag verification failed.");
+        }
+        if (batch + slots < batches) {
+            queue(batch + slots);
+        }
+        sink(base, chunks, plaintext.data());
+    }
+    return nullptr;
+}
+
+// addChunkTags without the mapping: each tag is read on its own through io, with up to
+// AsyncIo::kDefaultDepth reads in flight.
+bool Encryption::readChunkTags(AsyncIo& io, ChunkDigest& digest, const MappedFile& file, const ChunkedFileHeader& header, const ChunkLayout& layout, uint64_t first, uint64_t count) {
+    size_t window = static_cast<size_t>(std::min<uint64_t>(count, AsyncIo::kDefaultDepth));
+    std::vector<uint8_t> tags(window * TAG_SIZE);
+    std::vector<AsyncIo::Ticket> tickets(window);
+    auto queue = [&](uint64_t i) {
+        size_t slot = static_cast<size_t>(i % window);
+        tickets[slot] = io.read(file.descriptor(), &tags[slot * TAG_SIZE], TAG_SIZE, layout.tagOffset(header, first + i));
+    };
+    for (uint64_t i = 0; i < window; ++i) {
+        queue(i);
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        size_t slot = static_cast<size_t>(i % window);
+        if (!io.wait(tickets[slot]) || !digest.toggle(first + i, &tags[slot * TAG_SIZE])) {
+            io.drain();
+            return false;
+        }
+        if (i + window < count) {
+            queue(i + window);
+        }
+    }
+    return true;
+}
+
+// Writes each batch to output, through a streaming decompressor for compressed files. Only
+// the header is read through the mapping. Like a short compressed stream, a chunk digest
+// that does not match is only found once the chunks before it are written.
+void Encryption::decryptStream(const std::string& filePath, const std::vector<uint8_t>& key, std::ostream& output) {
+    MappedFile file;
+    ChunkedFileHeader header{};
+    ChunkLayout layout{};
+    std::vector<uint8_t> dataKey;
+    KeyWipe wipeDataKey(dataKey);
+    FileMetadata metadata{};
+    if (!mapForDecryption(filePath, key, MADV_RANDOM, file, header, layout, dataKey, metadata)) {
+        output << decryptLegacy(file, key);
+        return;
+    }
+
+    std::unique_ptr<Compression::Inflater> inflater;
+    if (ChunkFormat::isCompressed(header)) {
+        inflater = std::make_unique<Compression::Inflater>(output);
+    }
 
-    std::string ptOutput(decryptedText.begin(), decryptedText.begin() + plaintextLen);
-    
-    // Fix: Delete first character if it's a space
-    if (!ptOutput.empty() && ptOutput[0] == ' ') {
-        ptOutput.erase(0, 1);
+    bool checkDigest = ChunkFormat::hasChunkDigest(header);
+    ChunkDigest digest(dataKey);
+    AsyncIo io(scanDepth(header, layout.chunk_count));
+    const char* error = scanChunks(io, file, header, layout, dataKey, 0, layout.chunk_count, checkDigest ? &digest : nullptr,
+                                   [&](uint64_t base, size_t count, const unsigned char* plaintext) {
+        uint64_t batchEnd = std::min<uint64_t>(layout.plaintext_size, (base + count) * header.chunk_size);
+        size_t batchLength = batchEnd - base * header.chunk_size;
+        if (!inflater) {
+            output.write(reinterpret_cast<const char*>(plaintext), batchLength);
+        } else if (!inflater->update(plaintext, batchLength)) {
+            handleErrors("Decompression failed.");
+        }
+    });
+    if (error == nullptr && checkDigest && !digest.matches(metadata.chunk_digest)) {
+        error = "Tag verification failed.";
+    }
+    if (error != nullptr) {
+        handleErrors(error);
+    }
+    if (inflater && !inflater->finish()) {
+        handleErrors("Decompression failed.");
+    }
+}
+
+// Only the chunks that overlap the range are decrypted, a batch at a time, and the bytes
+// they share with it copied into the result. Every chunk's tag still goes into the chunk
+// digest, since a chunk that verifies on its own may be left over from an earlier version of
+// the file; the tags of the other chunks are read on their own, many at a time.
+std::string Encryption::readRange(const std::string& filePath, uint64_t offset, uint64_t length, const std::vector<uint8_t>& key) {
+    MappedFile file;
+    ChunkedFileHeader header{};
+    ChunkLayout layout{};
+    std::vector<uint8_t> dataKey;
+    KeyWipe wipeDataKey(dataKey);
+    FileMetadata metadata{};
+    if (!mapForDecryption(filePath, key, MADV_RANDOM, file, header, layout, dataKey, metadata)) {
+        std::string plaintext = decryptLegacy(file, key);
+        return offset < plaintext.size() ? plaintext.substr(offset, length) : std::string();
+    }
+    if (ChunkFormat::isCompressed(header)) {
+        std::string plaintext = decryptFile(filePath, key);
+        return offset < plaintext.size() ? plaintext.substr(offset, length) : std::string();
+    }
+    if (offset >= layout.plaintext_size || length == 0) {
+        return std::string();
+    }
+    uint64_t end = offset + std::min(length, layout.plaintext_size - offset);
+    uint64_t first = offset / header.chunk_size;
+    uint64_t last = (end - 1) / header.chunk_size;
+
+    std::string plaintext(end - offset, '\0');
+    bool checkDigest = ChunkFormat::hasChunkDigest(header);
+    ChunkDigest digest(dataKey);
+    AsyncIo io(scanDepth(header, checkDigest ? layout.chunk_count : last - first + 1));
+    const char* error = scanChunks(io, file, header, layout, dataKey, first, last - first + 1, checkDigest ? &digest : nullptr,
+                                   [&](uint64_t base, size_t count, const unsigned char* batch) {
+        uint64_t batchStart = base * header.chunk_size;
+        uint64_t from = std::max(offset, batchStart);
+        uint64_t to = std::min<uint64_t>(end, (base + count) * header.chunk_size);
+        std::memcpy(&plaintext[from - offset], batch + (from - batchStart), to - from);
+    });
+    if (error == nullptr && checkDigest &&
+        !(readChunkTags(io, digest, file, header, layout, 0, first) &&
+          readChunkTags(io, digest, file, header, layout, last + 1, layout.chunk_count - last - 1) &&
+          digest.matches(metadata.chunk_digest))) {
+        error = "Tag verification failed.";
+    }
+    if (error != nullptr) {
+        handleErrors(error);
+    }
+    return plaintext;
+}
+
+std::string Encryption::decryptLegacy(const MappedFile& file, const std::vector<uint8_t>& key) {
+    std::string plaintext;
+    if (const char* error = openLegacy(file, key, plaintext)) {
+        handleErrors(error);
+    }
+    return plaintext;
+}
+
+// Files from before the chunked format: IV, tag, then the whole content as one GCM message.
+const char* Encryption::openLegacy(const MappedFile& file, const std::vector<uint8_t>& key, std::string& plaintext) {
+    if (file.size() < IV_SIZE + TAG_SIZE) {
+        return "Tag verification failed.";
     }
+    if (key.size() != KEY_SIZE) {
+        return "Decryption initialization failed.";
+    }
+    const uint8_t* iv = file.data();
+    uint8_t tag[TAG_SIZE];
+    std::memcpy(tag, file.data() + IV_SIZE, TAG_SIZE);
+    const uint8_t* ciphertext = file.data() + IV_SIZE + TAG_SIZE;
+    size_t ciphertextLen = file.size() - IV_SIZE - TAG_SIZE;
+
+    try {
+        // Legacy files were sealed by setting a 16-byte IV length after the IV was loaded, which
+        // OpenSSL 1.1 ignored: the IV in effect was the first kLegacyIvLength bytes of the stored one.
+        CipherContextPool::Lease lease = CipherContextPool::local().acquire(CipherSuites::cipher(CipherSuite::Aes256Gcm), key.data(), iv, kLegacyIvLength, false);
+        EVP_CIPHER_CTX* ctx = lease.get();
 
-    return ptOutput;
+        plaintext.assign(ciphertextLen, '\0');
+        unsigned char* decryptedText = reinterpret_cast<unsigned char*>(&plaintext[0]);
+
+        int len = 0;
+        if (1 != EVP_DecryptUpdate(ctx, decryptedText, &len, ciphertext, static_cast<int>(ciphertextLen))) {
+            return "Decryption failed.";
+        }
+
+        if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, tag)) {
+            return "Failed to set expected tag.";
+        }
+
+        if (1 != EVP_DecryptFinal_ex(ctx, decryptedText + len, &len)) {
+            return "Tag verification failed.";
+        }
+    } catch (const std::exception&) {
+        return "Decryption initialization failed.";
+    }
+
+    // The contents were encrypted together with BLOCK_SIZE bytes of zero padding
+    if (plaintext.size() < BLOCK_SIZE) {
+        return "Tag verification failed.";
+    }
+    plaintext.resize(plaintext.size() - BLOCK_SIZE);
+
+    // Fix: Delete first character if it's a space. Legacy files kept the separator that
+    // followed the filename in mkfile; the chunked path stores contents as given.
+    if (!plaintext.empty() && plaintext[0] == ' ') {
+        plaintext.erase(0, 1);
+    }
+    return nullptr;
 }
 
 #endif // FILESERVER_ENCRYPTION_H
@@ -0,0 +1,113 @@
+/*
+* Keyring: the user keys of the current session, read from common/<user>_key once each and
+* kept in memory until the process exits.
+*
+* Key bytes are locked into RAM so they are never written to swap, and wiped when the
+* keyring is destroyed at exit. Locking is best effort: a key whose pages cannot be locked,
+* for instance past RLIMIT_MEMLOCK, is still kept.
+*/
+
+#ifndef KEYRING_H
+#define KEYRING_H
+
+#include <openssl/crypto.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Keyring {
+public:
+    Keyring() = default;
+    ~Keyring();
+
+    Keyring(const Keyring&) = delete;
+    Keyring& operator=(const Keyring&) = delete;
+
+    /// The process-wide keyring
+    static Keyring& session();
+
+    /// Look up a user's key, reading it from disk the first time it is asked for
+    /// \param userName    Owner of the key
+    /// \param directory   Directory holding <userName>_key
+    /// \param keySize     Size of the key in bytes
+    /// \return The key, valid until exit, or an empty key if it could not be read
+    const std::vector<uint8_t>& get(const std::string& userName, const std::string& directory, size_t keySize);
+
+private:
+    static bool load(const std::string& path, std::vector<uint8_t>& key);
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::vector<uint8_t>> keys_;
+};
+
+Keyring::~Keyring() {
+    for (auto& entry : keys_) {
+        OPENSSL_cleanse(entry.second.data(), entry.second.size());
+    }
+}
+
+Keyring& Keyring::session() {
+    static Keyring keyring;
+    return keyring;
+}
+
+// Failed reads are not remembered, so a user added later in the session is found then.
+const std::vector<uint8_t>& Keyring::get(const std::string& userName, const std::string& directory, size_t keySize) {
+    static const std::vector<uint8_t> missing;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = keys_.find(userName);
+    if (it != keys_.end()) {
+        return it->second;
+    }
+
+    // The buffer is locked before the key is read into it and keeps its address once it
+    // is moved into the map.
+    std::vector<uint8_t> key(keySize);
+    mlock(key.data(), key.size());
+    if (!load(directory + userName + "_key", key)) {
+        OPENSSL_cleanse(key.data(), key.size());
+        std::cerr << "Failed to read key from metadata for " << userName << std::endl;
+        return missing;
+    }
+    return keys_.emplace(userName, std::move(key)).first->second;
+}
+
+// Read straight into the locked buffer, so no stream buffer is left holding a copy.
+bool Keyring::load(const std::string& path, std::vector<uint8_t>& key) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    size_t filled = 0;
+    while (filled < key.size()) {
+        ssize_t count = ::read(fd, key.data() + filled, key.size() - filled);
+        if (count <= 0) {
+            break;
+        }
+        filled += static_cast<size_t>(count);
+    }
+    ::close(fd);
+    return filled == key.size();
+}
+
+/// Wipes a key held outside the keyring, such as a file's unwrapped data key, when it goes
+/// out of scope. The vector must outlive the guard.
+class KeyWipe {
+public:
+    explicit KeyWipe(std::vector<uint8_t>& key) : key_(key) {}
+    ~KeyWipe() { OPENSSL_cleanse(key_.data(), key_.size()); }
+
+    KeyWipe(const KeyWipe&) = delete;
+    KeyWipe& operator=(const KeyWipe&) = delete;
+
+private:
+    std::vector<uint8_t>& key_;
+};
+
+#endif // KEYRING_H
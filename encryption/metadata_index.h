@@ -0,0 +1,444 @@
+/*
+* Metadata index: process-lifetime view of the filename mappings. The base table is the
+* memory-mapped binary snapshot in common/structure.bin, queried in place; mappings added
+* since the last snapshot live in an overlay indexed by hash maps in both directions.
+* Lookups take string views, never touch the disk and never allocate.
+*
+* New mappings are appended to common/structure.journal, one JSON record per line, and
+* replayed on top of the snapshot at startup. Once the journal grows past
+* kCompactThreshold records it is folded into a fresh snapshot and truncated.
+*
+* Journal writes are group-committed: records wait in memory for at most the commit
+* latency (EFS_COMMIT_LATENCY_MS, default kDefaultCommitLatency) and are then written and
+* fdatasync'ed together by a background thread. A latency of 0 commits every record
+* before Add returns. Pending records are also committed on exit and before compaction.
+*
+* Mappings are also partitioned by parent directory, so LoadDirectory returns one
+* directory's table without walking the rest of the filesystem. Recursive queries go
+* through a PathTree over plaintext paths, built on first use and kept current as mappings
+* are added.
+*
+* Filesystems created before the binary format keep their names in common/structure.json;
+* that file is converted to a snapshot the first time it is loaded.
+*/
+
+#ifndef METADATA_INDEX_H
+#define METADATA_INDEX_H
+
+#include "helpers/json.hpp"
+#include "encryption/metadata_snapshot.h"
+#include "encryption/path_tree.h"
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+// Randomized name -> plaintext name for the entries of one directory.
+using DirectoryTable = std::unordered_map<std::string, std::string>;
+
+class MetadataIndex {
+public:
+    static MetadataIndex& Instance(const std::string& path_to_metadata);
+
+    std::string_view FindPlaintext(std::string_view randomized_name) const;
+    std::string_view FindRandomized(std::string_view plaintext_path) const;
+    DirectoryTable LoadDirectory(std::string_view directory_path) const;
+    const PathTree& Tree();
+    void Add(const std::string& randomized_name, const std::string& plaintext_path);
+    void Compact();
+    json ToJson() const;
+
+    /// Bumped on every new mapping, so callers can tell when derived caches went stale.
+    uint64_t Generation() const { return generation_; }
+
+    ~MetadataIndex();
+
+private:
+    static constexpr size_t kCompactThreshold = 4096;
+    static constexpr size_t kMaxPendingRecords = 256;
+    static constexpr std::chrono::milliseconds kDefaultCommitLatency{20};
+
+    // Overlay entries live in a deque so the views held by the hash maps stay valid.
+    struct OverlayEntry {
+        std::string randomized_name;
+        std::string plaintext_path;
+    };
+
+    explicit MetadataIndex(const fs::path& common_path);
+    void Load();
+    void MigrateFromJson();
+    void ReplayJournal();
+    void Insert(const std::string& randomized_name, const std::string& plaintext_path);
+    std::string SpellOut(std::string_view plaintext_path) const;
+    void CommitLocked();
+    void TruncateJournalLocked();
+    void RunFlusher();
+
+    fs::path snapshot_path_;
+    fs::path legacy_path_;
+    fs::path journal_path_;
+    MetadataSnapshot snapshot_;
+    size_t journal_records_ = 0;
+    uint64_t generation_ = 0;
+    std::deque<OverlayEntry> overlay_;
+    std::unordered_map<std::string_view, const OverlayEntry*> by_randomized_;
+    std::unordered_map<std::string_view, const OverlayEntry*> by_plaintext_;
+    std::unordered_map<std::string_view, std::vector<const OverlayEntry*>> by_directory_;
+    std::unique_ptr<PathTree> tree_;
+
+    // Group commit state, shared with the flusher thread under commit_mutex_.
+    std::mutex commit_mutex_;
+    std::condition_variable commit_cv_;
+    std::thread flusher_;
+    bool stopping_ = false;
+    std::chrono::milliseconds commit_latency_ = kDefaultCommitLatency;
+    int journal_fd_ = -1;
+    std::string pending_;
+    size_t pending_records_ = 0;
+};
+
+MetadataIndex& MetadataIndex::Instance(const std::string& path_to_metadata) {
+    // Callers change the working directory, so key the cache on the absolute metadata path.
+    static std::map<std::string, std::unique_ptr<MetadataIndex>> instances;
+    fs::path common_path = fs::absolute(fs::path(path_to_metadata) / "common").lexically_normal();
+
+    std::unique_ptr<MetadataIndex>& instance = instances[common_path.string()];
+    if (!instance) {
+        instance.reset(new MetadataIndex(common_path));
+        instance->Load();
+    }
+    return *instance;
+}
+
+MetadataIndex::MetadataIndex(const fs::path& common_path)
+    : snapshot_path_(common_path / "structure.bin"),
+      legacy_path_(common_path / "structure.json"),
+      journal_path_(common_path / "structure.journal") {
+    if (const char* latency = std::getenv("EFS_COMMIT_LATENCY_MS")) {
+        commit_latency_ = std::chrono::milliseconds(std::strtol(latency, nullptr, 10));
+    }
+}
+
+MetadataIndex::~MetadataIndex() {
+    {
+        std::lock_guard<std::mutex> lock(commit_mutex_);
+        stopping_ = true;
+    }
+    commit_cv_.notify_all();
+    if (flusher_.joinable()) {
+        flusher_.join();
+    }
+
+    std::lock_guard<std::mutex> lock(commit_mutex_);
+    CommitLocked();
+    if (journal_fd_ >= 0) {
+        ::close(journal_fd_);
+    }
+}
+
+void MetadataIndex::Load() {
+    if (!fs::exists(snapshot_path_) && fs::exists(legacy_path_)) {
+        MigrateFromJson();
+    }
+    snapshot_.Open(snapshot_path_);
+    ReplayJournal();
+
+    if (snapshot_.Version() < MetadataSnapshot::kVersion) {
+        Compact();
+    }
+}
+
+void MetadataIndex::MigrateFromJson() {
+    std::ifstream metadata_file(legacy_path_);
+    if (!metadata_file.is_open()) {
+        throw std::runtime_error("Failed to open structure.json file");
+    }
+
+    json metadata_json = json::parse(metadata_file);
+    std::vector<std::pair<std::string, std::string>> entries;
+    entries.reserve(metadata_json.size());
+    for (auto& [key, value] : metadata_json.items()) {
+        if (value.is_string()) {
+            entries.emplace_back(key, value.get<std::string>());
+        }
+    }
+    metadata_file.close();
+
+    MetadataSnapshot::Write(snapshot_path_, std::move(entries));
+    fs::remove(legacy_path_);
+}
+
+void MetadataIndex::ReplayJournal() {
+    std::ifstream journal_file(journal_path_);
+    std::string line;
+    std::uintmax_t intact_bytes = 0;
+    bool torn = false;
+    while (std::getline(journal_file, line)) {
+        json record = json::parse(line, nullptr, false);
+        if (journal_file.eof() || record.is_discarded() || !record.is_array() || record.size() != 2 ||
+            !record[0].is_string() || !record[1].is_string()) {
+            torn = true;
+            break;
+        }
+        Insert(record[0].get<std::string>(), record[1].get<std::string>());
+        ++journal_records_;
+        intact_bytes += line.size() + 1;
+    }
+    journal_file.close();
+
+    // A crash mid-append leaves a torn last record; cut it off so new records start on a clean line.
+    if (torn) {
+        fs::resize_file(journal_path_, intact_bytes);
+    }
+}
+
+std::string_view MetadataIndex::FindPlaintext(std::string_view randomized_name) const {
+    auto it = by_randomized_.find(randomized_name);
+    if (it != by_randomized_.end()) {
+        return it->second->plaintext_path;
+    }
+    return snapshot_.FindPlaintext(randomized_name);
+}
+
+std::string_view MetadataIndex::FindRandomized(std::string_view plaintext_path) const {
+    std::string_view from_snapshot = snapshot_.FindRandomized(plaintext_path);
+
+    // The overlay wins over the snapshot, so a snapshot hit is only valid if the forward map agrees.
+    if (!from_snapshot.empty() && by_randomized_.count(from_snapshot) != 0) {
+        from_snapshot = {};
+    }
+
+    auto it = by_plaintext_.find(plaintext_path);
+    if (it == by_plaintext_.end()) {
+        return from_snapshot;
+    }
+
+    // A path registered twice resolves to the smallest randomized name, as the sorted JSON scan did.
+    if (!from_snapshot.empty() && from_snapshot < it->second->randomized_name) {
+        return from_snapshot;
+    }
+    return it->second->randomized_name;
+}
+
+DirectoryTable MetadataIndex::LoadDirectory(std::string_view directory_path) const {
+    DirectoryTable table;
+    snapshot_.ForEachInDirectory(directory_path, [&](std::string_view randomized_name, std::string_view plaintext_path) {
+        if (by_randomized_.count(randomized_name) == 0) {
+            table.emplace(randomized_name, MetadataSnapshot::NameOf(plaintext_path));
+        }
+    });
+
+    auto it = by_directory_.find(directory_path);
+    if (it != by_directory_.end()) {
+        for (const OverlayEntry* entry : it->second) {
+            if (by_randomized_.at(entry->randomized_name) == entry) {
+                table[entry->randomized_name] = std::string(MetadataSnapshot::NameOf(entry->plaintext_path));
+            }
+        }
+    }
+    return table;
+}
+
+const PathTree& MetadataIndex::Tree() {
+    if (!tree_) {
+        tree_ = std::make_unique<PathTree>();
+        snapshot_.ForEach([&](std::string_view randomized_name, std::string_view plaintext_path) {
+            if (by_randomized_.count(randomized_name) == 0) {
+                tree_->Insert(SpellOut(plaintext_path), randomized_name);
+            }
+        });
+        for (const auto& [randomized_name, entry] : by_randomized_) {
+            tree_->Insert(SpellOut(entry->plaintext_path), entry->randomized_name);
+        }
+    }
+    return *tree_;
+}
+
+// Mappings name their parent directories by randomized name, as in
+// "/filesystem/<user dir>/personal"; the tree wants every component in plaintext.
+std::string MetadataIndex::SpellOut(std::string_view plaintext_path) const {
+    size_t name_start = plaintext_path.rfind('/');
+    if (name_start == std::string_view::npos) {
+        return std::string(plaintext_path);
+    }
+    std::string path;
+    size_t start = 0;
+    while (start < name_start) {
+        size_t end = plaintext_path.find('/', start);
+        std::string_view component = plaintext_path.substr(start, end - start);
+        std::string_view parent = component.empty() ? std::string_view() : FindPlaintext(component);
+        path += parent.empty() ? component : MetadataSnapshot::NameOf(parent);
+        path += '/';
+        start = end + 1;
+    }
+    path += plaintext_path.substr(name_start + 1);
+    return path;
+}
+
+void MetadataIndex::Insert(const std::string& randomized_name, const std::string& plaintext_path) {
+    const OverlayEntry* entry = &overlay_.emplace_back(OverlayEntry{randomized_name, plaintext_path});
+
+    // Re-registering a randomized name moves it; drop the reverse entry of its old path.
+    auto [forward, inserted_forward] = by_randomized_.emplace(entry->randomized_name, entry);
+    if (!inserted_forward) {
+        auto stale = by_plaintext_.find(forward->second->plaintext_path);
+        if (stale != by_plaintext_.end() && stale->second == forward->second) {
+            by_plaintext_.erase(stale);
+        }
+        forward->second = entry;
+    }
+    if (tree_ && (!inserted_forward || !snapshot_.FindPlaintext(randomized_name).empty())) {
+        // A moved directory takes its whole subtree to new plaintext paths; rebuild on next use.
+        tree_.reset();
+    } else if (tree_) {
+        tree_->Insert(SpellOut(entry->plaintext_path), entry->randomized_name);
+    }
+    by_directory_[MetadataSnapshot::ParentOf(entry->plaintext_path)].push_back(entry);
+
+    auto [reverse, inserted_reverse] = by_plaintext_.emplace(entry->plaintext_path, entry);
+    if (!inserted_reverse && entry->randomized_name < reverse->second->randomized_name) {
+        reverse->second = entry;
+    }
+}
+
+void MetadataIndex::Add(const std::string& randomized_name, const std::string& plaintext_path) {
+    Insert(randomized_name, plaintext_path);
+    ++generation_;
+
+    {
+        std::lock_guard<std::mutex> lock(commit_mutex_);
+        pending_ += json::array({randomized_name, plaintext_path}).dump();
+        pending_ += '\n';
+        ++pending_records_;
+
+        if (commit_latency_.count() <= 0 || pending_records_ >= kMaxPendingRecords) {
+            CommitLocked();
+        } else if (!flusher_.joinable()) {
+            flusher_ = std::thread(&MetadataIndex::RunFlusher, this);
+        }
+    }
+    commit_cv_.notify_one();
+
+    if (++journal_records_ >= kCompactThreshold) {
+        Compact();
+    }
+}
+
+// Waits for the first pending record, gives later ones up to the commit latency to join
+// it, then commits them all with one write and one fdatasync.
+void MetadataIndex::RunFlusher() {
+    std::unique_lock<std::mutex> lock(commit_mutex_);
+    while (!stopping_) {
+        commit_cv_.wait(lock, [this] { return stopping_ || pending_records_ > 0; });
+        if (stopping_) {
+            break;
+        }
+        commit_cv_.wait_for(lock, commit_latency_, [this] { return stopping_; });
+        CommitLocked();
+    }
+}
+
+void MetadataIndex::CommitLocked() {
+    if (pending_.empty()) {
+        return;
+    }
+    if (journal_fd_ < 0) {
+        journal_fd_ = ::open(journal_path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (journal_fd_ < 0) {
+            std::cerr << "Failed to open structure.journal file" << std::endl;
+            return;
+        }
+    }
+
+    size_t written_total = 0;
+    while (written_total < pending_.size()) {
+        ssize_t written = ::write(journal_fd_, pending_.data() + written_total, pending_.size() - written_total);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            // Keep only what did not reach the journal, so the next commit finishes the
+            // record it cut short instead of starting the batch over behind it.
+            std::cerr << "Failed to write structure.journal file" << std::endl;
+            pending_.erase(0, written_total);
+            return;
+        }
+        written_total += static_cast<size_t>(written);
+    }
+    if (fdatasync(journal_fd_) != 0) {
+        std::cerr << "Failed to sync structure.journal file" << std::endl;
+    }
+    pending_.clear();
+    pending_records_ = 0;
+}
+
+void MetadataIndex::TruncateJournalLocked() {
+    pending_.clear();
+    pending_records_ = 0;
+    if (journal_fd_ >= 0) {
+        ::close(journal_fd_);
+    }
+    journal_fd_ = ::open(journal_path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+    if (journal_fd_ >= 0) {
+        fdatasync(journal_fd_);
+    }
+}
+
+void MetadataIndex::Compact() {
+    std::vector<std::pair<std::string, std::string>> entries;
+    entries.reserve(snapshot_.Size() + by_randomized_.size());
+    snapshot_.ForEach([&](std::string_view randomized_name, std::string_view plaintext_path) {
+        if (by_randomized_.count(randomized_name) == 0) {
+            entries.emplace_back(randomized_name, plaintext_path);
+        }
+    });
+    for (const auto& [randomized_name, entry] : by_randomized_) {
+        entries.emplace_back(entry->randomized_name, entry->plaintext_path);
+    }
+
+    MetadataSnapshot::Write(snapshot_path_, std::move(entries));
+    snapshot_.Open(snapshot_path_);
+    by_randomized_.clear();
+    by_plaintext_.clear();
+    by_directory_.clear();
+    overlay_.clear();
+
+    // Pending records are part of the new snapshot. Replaying records already folded into
+    // it is harmless, so truncating after the rename is safe even if we stop in between.
+    std::lock_guard<std::mutex> lock(commit_mutex_);
+    TruncateJournalLocked();
+    journal_records_ = 0;
+}
+
+json MetadataIndex::ToJson() const {
+    json metadata_json = json::object();
+    snapshot_.ForEach([&](std::string_view randomized_name, std::string_view plaintext_path) {
+        metadata_json[std::string(randomized_name)] = std::string(plaintext_path);
+    });
+    for (const auto& [randomized_name, entry] : by_randomized_) {
+        metadata_json[entry->randomized_name] = entry->plaintext_path;
+    }
+    return metadata_json;
+}
+
+#endif // METADATA_INDEX_H
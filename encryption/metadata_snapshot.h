@@ -0,0 +1,456 @@
+/*
+* Metadata snapshot: compact binary name table stored in common/structure.bin.
+*
+* The file is memory-mapped and queried in place. Layout (native byte order):
+*   SnapshotHeader
+*   SnapshotEntry[entry_count]          sorted by randomized name
+*   uint32_t[entry_count]               entry indexes sorted by plaintext path
+*   SnapshotDirectory[directory_count]  sorted by directory path
+*   uint32_t[entry_count]               entry indexes grouped by parent directory
+*   uint64_t[bloom_bits / 64]           Bloom filter over plaintext paths
+*   string pool                         names and paths referenced by offset/length
+*
+* The directory section gives every parent path its own contiguous table of children, so
+* listing a directory touches only that directory's entries. The Bloom filter answers most
+* lookups of paths that do not exist without searching the plaintext index.
+*
+* Older versions lack the later sections and are rewritten by the metadata index when loaded.
+*/
+
+#ifndef METADATA_SNAPSHOT_H
+#define METADATA_SNAPSHOT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint64_t entries_offset;
+    uint64_t plaintext_index_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    // Version 2 and later.
+    uint32_t directory_count;
+    uint32_t reserved;
+    uint64_t directories_offset;
+    uint64_t children_offset;
+    // Version 3 and later.
+    uint64_t bloom_offset;
+    uint32_t bloom_bits;
+    uint32_t bloom_hashes;
+};
+
+constexpr size_t kSnapshotHeaderSizeV1 = offsetof(SnapshotHeader, directory_count);
+constexpr size_t kSnapshotHeaderSizeV2 = offsetof(SnapshotHeader, bloom_offset);
+
+struct SnapshotEntry {
+    uint32_t randomized_offset;
+    uint32_t randomized_length;
+    uint32_t plaintext_offset;
+    uint32_t plaintext_length;
+};
+
+// A directory path is a prefix of its children's paths, so it points into the string pool too.
+struct SnapshotDirectory {
+    uint32_t path_offset;
+    uint32_t path_length;
+    uint32_t first_child;
+    uint32_t child_count;
+};
+
+class MetadataSnapshot {
+public:
+    static constexpr char kMagic[8] = {'E', 'F', 'S', 'M', 'E', 'T', 'A', '\0'};
+    static constexpr uint32_t kVersion = 3;
+    static constexpr uint32_t kBloomBitsPerEntry = 10;
+    static constexpr uint32_t kBloomHashes = 7;
+
+    MetadataSnapshot() = default;
+    ~MetadataSnapshot();
+    MetadataSnapshot(const MetadataSnapshot&) = delete;
+    MetadataSnapshot& operator=(const MetadataSnapshot&) = delete;
+
+    void Open(const fs::path& snapshot_path);
+    void Close();
+
+    size_t Size() const { return data_ ? header_.entry_count : 0; }
+    uint32_t Version() const { return data_ ? header_.version : 0; }
+    std::string_view FindPlaintext(std::string_view randomized_name) const;
+    std::string_view FindRandomized(std::string_view plaintext_path) const;
+    bool MayContainPlaintext(std::string_view plaintext_path) const;
+
+    template <typename Callback>
+    void ForEach(Callback&& callback) const;
+    template <typename Callback>
+    void ForEachInDirectory(std::string_view directory_path, Callback&& callback) const;
+
+    static void Write(const fs::path& snapshot_path, std::vector<std::pair<std::string, std::string>> entries);
+
+    static std::string_view ParentOf(std::string_view plaintext_path);
+    static std::string_view NameOf(std::string_view plaintext_path);
+
+private:
+    static uint64_t BloomHash(std::string_view plaintext_path);
+    static void WriteDurably(const fs::path& snapshot_path, std::initializer_list<std::pair<const void*, size_t>> parts);
+
+    std::string_view RandomizedAt(uint32_t entry) const;
+    std::string_view PlaintextAt(uint32_t entry) const;
+    std::string_view DirectoryAt(uint32_t directory) const;
+    std::string_view String(uint32_t offset, uint32_t length) const;
+
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    SnapshotHeader header_{};
+    const SnapshotEntry* entries_ = nullptr;
+    const uint32_t* plaintext_index_ = nullptr;
+    const SnapshotDirectory* directories_ = nullptr;
+    const uint32_t* children_ = nullptr;
+    const uint64_t* bloom_ = nullptr;
+    const char* strings_ = nullptr;
+};
+
+MetadataSnapshot::~MetadataSnapshot() {
+    Close();
+}
+
+void MetadataSnapshot::Open(const fs::path& snapshot_path) {
+    Close();
+
+    int fd = ::open(snapshot_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open structure.bin file");
+    }
+    struct stat file_info;
+    if (fstat(fd, &file_info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to stat structure.bin file");
+    }
+    size_ = static_cast<size_t>(file_info.st_size);
+    if (size_ < kSnapshotHeaderSizeV1) {
+        ::close(fd);
+        throw std::runtime_error("Corrupt structure.bin file");
+    }
+
+    void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        size_ = 0;
+        throw std::runtime_error("Failed to map structure.bin file");
+    }
+    data_ = static_cast<const uint8_t*>(mapping);
+
+    // Older headers are a prefix of the current one; fields they lack read as zero.
+    std::memcpy(&header_, data_, kSnapshotHeaderSizeV1);
+    size_t header_size = header_.version >= 3 ? sizeof(SnapshotHeader)
+                       : header_.version == 2 ? kSnapshotHeaderSizeV2
+                       : kSnapshotHeaderSizeV1;
+    if (size_ < header_size) {
+        Close();
+        throw std::runtime_error("Corrupt structure.bin file");
+    }
+    std::memcpy(&header_, data_, header_size);
+
+    uint64_t count = header_.entry_count;
+    bool valid = std::memcmp(header_.magic, kMagic, sizeof(kMagic)) == 0 &&
+                 header_.version >= 1 && header_.version <= kVersion &&
+                 header_.entries_offset + count * sizeof(SnapshotEntry) <= size_ &&
+                 header_.plaintext_index_offset + count * sizeof(uint32_t) <= size_ &&
+                 header_.strings_offset + header_.strings_size <= size_;
+    if (valid && header_.version >= 2) {
+        valid = header_.directories_offset + header_.directory_count * sizeof(SnapshotDirectory) <= size_ &&
+                header_.children_offset + count * sizeof(uint32_t) <= size_;
+    }
+    if (valid && header_.version >= 3) {
+        valid = header_.bloom_bits % 64 == 0 && header_.bloom_offset + header_.bloom_bits / 8 <= size_;
+    }
+    if (!valid) {
+        Close();
+        throw std::runtime_error("Corrupt structure.bin file");
+    }
+
+    entries_ = reinterpret_cast<const SnapshotEntry*>(data_ + header_.entries_offset);
+    plaintext_index_ = reinterpret_cast<const uint32_t*>(data_ + header_.plaintext_index_offset);
+    directories_ = reinterpret_cast<const SnapshotDirectory*>(data_ + header_.directories_offset);
+    children_ = reinterpret_cast<const uint32_t*>(data_ + header_.children_offset);
+    bloom_ = reinterpret_cast<const uint64_t*>(data_ + header_.bloom_offset);
+    strings_ = reinterpret_cast<const char*>(data_ + header_.strings_offset);
+}
+
+void MetadataSnapshot::Close() {
+    if (data_ != nullptr) {
+        munmap(const_cast<uint8_t*>(data_), size_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+    header_ = SnapshotHeader{};
+    entries_ = nullptr;
+    plaintext_index_ = nullptr;
+    directories_ = nullptr;
+    children_ = nullptr;
+    bloom_ = nullptr;
+    strings_ = nullptr;
+}
+
+std::string_view MetadataSnapshot::String(uint32_t offset, uint32_t length) const {
+    if (static_cast<uint64_t>(offset) + length > header_.strings_size) {
+        return {};
+    }
+    return std::string_view(strings_ + offset, length);
+}
+
+std::string_view MetadataSnapshot::RandomizedAt(uint32_t entry) const {
+    return String(entries_[entry].randomized_offset, entries_[entry].randomized_length);
+}
+
+std::string_view MetadataSnapshot::PlaintextAt(uint32_t entry) const {
+    return String(entries_[entry].plaintext_offset, entries_[entry].plaintext_length);
+}
+
+std::string_view MetadataSnapshot::DirectoryAt(uint32_t directory) const {
+    return String(directories_[directory].path_offset, directories_[directory].path_length);
+}
+
+std::string_view MetadataSnapshot::ParentOf(std::string_view plaintext_path) {
+    size_t slash = plaintext_path.find_last_of('/');
+    return slash == std::string_view::npos ? std::string_view() : plaintext_path.substr(0, slash);
+}
+
+std::string_view MetadataSnapshot::NameOf(std::string_view plaintext_path) {
+    size_t slash = plaintext_path.find_last_of('/');
+    return slash == std::string_view::npos ? plaintext_path : plaintext_path.substr(slash + 1);
+}
+
+// FNV-1a; the filter is persisted, so the hash must not depend on the standard library.
+uint64_t MetadataSnapshot::BloomHash(std::string_view plaintext_path) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : plaintext_path) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool MetadataSnapshot::MayContainPlaintext(std::string_view plaintext_path) const {
+    if (header_.bloom_bits == 0) {
+        return Size() > 0;
+    }
+
+    // Double hashing: probe i is h1 + i * h2, with h2 forced odd.
+    uint64_t h1 = BloomHash(plaintext_path);
+    uint64_t h2 = (h1 >> 33 | h1 << 31) | 1;
+    for (uint32_t i = 0; i < header_.bloom_hashes; ++i) {
+        uint64_t bit = (h1 + i * h2) % header_.bloom_bits;
+        if ((bloom_[bit / 64] & (1ull << (bit % 64))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string_view MetadataSnapshot::FindPlaintext(std::string_view randomized_name) const {
+    uint32_t low = 0, high = static_cast<uint32_t>(Size());
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (RandomizedAt(mid) < randomized_name) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < Size() && RandomizedAt(low) == randomized_name) {
+        return PlaintextAt(low);
+    }
+    return {};
+}
+
+std::string_view MetadataSnapshot::FindRandomized(std::string_view plaintext_path) const {
+    if (!MayContainPlaintext(plaintext_path)) {
+        return {};
+    }
+
+    uint32_t low = 0, high = static_cast<uint32_t>(Size());
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (PlaintextAt(plaintext_index_[mid]) < plaintext_path) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < Size() && plaintext_index_[low] < Size() && PlaintextAt(plaintext_index_[low]) == plaintext_path) {
+        return RandomizedAt(plaintext_index_[low]);
+    }
+    return {};
+}
+
+template <typename Callback>
+void MetadataSnapshot::ForEach(Callback&& callback) const {
+    for (uint32_t entry = 0; entry < Size(); ++entry) {
+        callback(RandomizedAt(entry), PlaintextAt(entry));
+    }
+}
+
+template <typename Callback>
+void MetadataSnapshot::ForEachInDirectory(std::string_view directory_path, Callback&& callback) const {
+    uint32_t low = 0, high = header_.directory_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (DirectoryAt(mid) < directory_path) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == header_.directory_count || DirectoryAt(low) != directory_path) {
+        return;
+    }
+
+    const SnapshotDirectory& directory = directories_[low];
+    for (uint32_t child = directory.first_child; child < directory.first_child + directory.child_count && child < Size(); ++child) {
+        uint32_t entry = children_[child];
+        if (entry < Size()) {
+            callback(RandomizedAt(entry), PlaintextAt(entry));
+        }
+    }
+}
+
+void MetadataSnapshot::Write(const fs::path& snapshot_path, std::vector<std::pair<std::string, std::string>> entries) {
+    std::sort(entries.begin(), entries.end());
+
+    std::vector<SnapshotEntry> table;
+    table.reserve(entries.size());
+    std::string strings;
+    for (const auto& [randomized_name, plaintext_path] : entries) {
+        SnapshotEntry entry;
+        entry.randomized_offset = static_cast<uint32_t>(strings.size());
+        entry.randomized_length = static_cast<uint32_t>(randomized_name.size());
+        strings += randomized_name;
+        entry.plaintext_offset = static_cast<uint32_t>(strings.size());
+        entry.plaintext_length = static_cast<uint32_t>(plaintext_path.size());
+        strings += plaintext_path;
+        table.push_back(entry);
+    }
+
+    // Stable sort keeps the smallest randomized name first among duplicate paths.
+    std::vector<uint32_t> plaintext_index(entries.size());
+    for (uint32_t i = 0; i < plaintext_index.size(); ++i) {
+        plaintext_index[i] = i;
+    }
+    std::stable_sort(plaintext_index.begin(), plaintext_index.end(), [&entries](uint32_t a, uint32_t b) {
+        return entries[a].second < entries[b].second;
+    });
+
+    std::vector<uint32_t> children(entries.size());
+    for (uint32_t i = 0; i < children.size(); ++i) {
+        children[i] = i;
+    }
+    std::stable_sort(children.begin(), children.end(), [&entries](uint32_t a, uint32_t b) {
+        return ParentOf(entries[a].second) < ParentOf(entries[b].second);
+    });
+
+    std::vector<SnapshotDirectory> directories;
+    std::string_view previous_parent;
+    for (uint32_t child = 0; child < children.size(); ++child) {
+        std::string_view parent = ParentOf(entries[children[child]].second);
+        if (directories.empty() || parent != previous_parent) {
+            uint32_t parent_length = static_cast<uint32_t>(parent.size());
+            directories.push_back({table[children[child]].plaintext_offset, parent_length, child, 0});
+            previous_parent = parent;
+        }
+        ++directories.back().child_count;
+    }
+
+    std::vector<uint64_t> bloom((std::max<size_t>(entries.size(), 1) * kBloomBitsPerEntry + 63) / 64);
+    uint32_t bloom_bits = static_cast<uint32_t>(bloom.size() * 64);
+    for (const auto& entry : entries) {
+        uint64_t h1 = BloomHash(entry.second);
+        uint64_t h2 = (h1 >> 33 | h1 << 31) | 1;
+        for (uint32_t i = 0; i < kBloomHashes; ++i) {
+            uint64_t bit = (h1 + i * h2) % bloom_bits;
+            bloom[bit / 64] |= 1ull << (bit % 64);
+        }
+    }
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.entry_count = static_cast<uint32_t>(entries.size());
+    header.directory_count = static_cast<uint32_t>(directories.size());
+    header.entries_offset = sizeof(SnapshotHeader);
+    header.plaintext_index_offset = header.entries_offset + table.size() * sizeof(SnapshotEntry);
+    header.directories_offset = header.plaintext_index_offset + plaintext_index.size() * sizeof(uint32_t);
+    header.children_offset = header.directories_offset + directories.size() * sizeof(SnapshotDirectory);
+    header.bloom_offset = header.children_offset + children.size() * sizeof(uint32_t);
+    header.bloom_bits = bloom_bits;
+    header.bloom_hashes = kBloomHashes;
+    header.strings_offset = header.bloom_offset + bloom.size() * sizeof(uint64_t);
+    header.strings_size = strings.size();
+
+    WriteDurably(snapshot_path, {
+        {&header, sizeof(header)},
+        {table.data(), table.size() * sizeof(SnapshotEntry)},
+        {plaintext_index.data(), plaintext_index.size() * sizeof(uint32_t)},
+        {directories.data(), directories.size() * sizeof(SnapshotDirectory)},
+        {children.data(), children.size() * sizeof(uint32_t)},
+        {bloom.data(), bloom.size() * sizeof(uint64_t)},
+        {strings.data(), strings.size()},
+    });
+}
+
+// Write to a temporary file, fsync it, rename it over the target and fsync the directory,
+// so a crash leaves either the old snapshot or the complete new one.
+void MetadataSnapshot::WriteDurably(const fs::path& snapshot_path, std::initializer_list<std::pair<const void*, size_t>> parts) {
+    fs::path temp_path = fs::path(snapshot_path).concat(".tmp");
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to write structure.bin snapshot");
+    }
+    for (const auto& [data, size] : parts) {
+        const char* cursor = static_cast<const char*>(data);
+        size_t remaining = size;
+        while (remaining > 0) {
+            ssize_t written = ::write(fd, cursor, remaining);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                ::close(fd);
+                throw std::runtime_error("Failed to write structure.bin snapshot");
+            }
+            cursor += written;
+            remaining -= static_cast<size_t>(written);
+        }
+    }
+    if (fsync(fd) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to sync structure.bin snapshot");
+    }
+    ::close(fd);
+
+    fs::rename(temp_path, snapshot_path);
+    int directory_fd = ::open(snapshot_path.parent_path().c_str(), O_RDONLY | O_DIRECTORY);
+    if (directory_fd >= 0) {
+        fsync(directory_fd);
+        ::close(directory_fd);
+    }
+}
+
+#endif // METADATA_SNAPSHOT_H
@@ -0,0 +1,155 @@
+/*
+* Path tree: radix tree over plaintext paths, one edge per path component.
+*
+* Every node knows how many mappings live in its subtree, so counting the entries under a
+* directory costs one walk down the path, and enumerating them visits only that subtree.
+* Paths are spelled out in plaintext, such as "/filesystem/bob/personal/projects", and a
+* directory's own mapping sits at its node, so the node for "/filesystem/<user>" covers
+* the user's directory and everything in it.
+*/
+
+#ifndef PATH_TREE_H
+#define PATH_TREE_H
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class PathTree {
+public:
+    void Insert(std::string_view path, std::string_view randomized_name);
+
+    /// Number of mappings below path, not counting path's own
+    size_t CountSubtree(std::string_view path) const;
+
+    /// Visit every mapping below path, not path's own, as (plaintext path, randomized path).
+    /// The randomized path names each component by its mapping, so it is where the entry is
+    /// stored on disk relative to the filesystem root.
+    template <typename Callback>
+    void ForEachInSubtree(std::string_view path, Callback&& callback) const;
+
+private:
+    struct Node {
+        std::map<std::string, std::unique_ptr<Node>, std::less<>> children;
+        std::string randomized_name;
+        size_t subtree_count = 0;
+    };
+
+    template <typename Visit>
+    static void ForEachComponent(std::string_view path, Visit&& visit);
+    const Node* Find(std::string_view path) const;
+    template <typename Callback>
+    static void Walk(const Node& node, std::string& path, std::string& randomized_path, Callback& callback);
+
+    Node root_;
+};
+
+template <typename Visit>
+void PathTree::ForEachComponent(std::string_view path, Visit&& visit) {
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string_view::npos) {
+            end = path.size();
+        }
+        if (end > start) {
+            visit(path.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+}
+
+void PathTree::Insert(std::string_view path, std::string_view randomized_name) {
+    std::vector<Node*> nodes{&root_};
+    ForEachComponent(path, [&](std::string_view component) {
+        Node* node = nodes.back();
+        auto it = node->children.find(component);
+        if (it == node->children.end()) {
+            it = node->children.emplace(std::string(component), std::make_unique<Node>()).first;
+        }
+        nodes.push_back(it->second.get());
+    });
+
+    Node* target = nodes.back();
+    if (!target->randomized_name.empty()) {
+        // A path registered twice keeps the smallest randomized name, like the index lookups.
+        if (randomized_name < target->randomized_name) {
+            target->randomized_name = std::string(randomized_name);
+        }
+        return;
+    }
+    target->randomized_name = std::string(randomized_name);
+    for (Node* node : nodes) {
+        ++node->subtree_count;
+    }
+}
+
+const PathTree::Node* PathTree::Find(std::string_view path) const {
+    const Node* node = &root_;
+    ForEachComponent(path, [&](std::string_view component) {
+        if (node == nullptr) {
+            return;
+        }
+        auto it = node->children.find(component);
+        node = it == node->children.end() ? nullptr : it->second.get();
+    });
+    return node;
+}
+
+size_t PathTree::CountSubtree(std::string_view path) const {
+    const Node* node = Find(path);
+    if (node == nullptr) {
+        return 0;
+    }
+    return node->subtree_count - (node->randomized_name.empty() ? 0 : 1);
+}
+
+template <typename Callback>
+void PathTree::ForEachInSubtree(std::string_view path, Callback&& callback) const {
+    std::string prefix;
+    std::string randomized_prefix;
+    const Node* node = &root_;
+    ForEachComponent(path, [&](std::string_view component) {
+        if (node == nullptr) {
+            return;
+        }
+        auto it = node->children.find(component);
+        node = it == node->children.end() ? nullptr : it->second.get();
+        if (node != nullptr) {
+            prefix += '/';
+            prefix += component;
+            randomized_prefix += '/';
+            randomized_prefix += node->randomized_name.empty() ? component : std::string_view(node->randomized_name);
+        }
+    });
+    if (node != nullptr) {
+        Walk(*node, prefix, randomized_prefix, callback);
+    }
+}
+
+// Visits the mappings below node, whose own paths are path and randomized_path.
+template <typename Callback>
+void PathTree::Walk(const Node& node, std::string& path, std::string& randomized_path, Callback& callback) {
+    for (const auto& [component, child] : node.children) {
+        if (child->subtree_count == 0) {
+            continue;
+        }
+        size_t length = path.size();
+        size_t randomized_length = randomized_path.size();
+        path += '/';
+        path += component;
+        randomized_path += '/';
+        randomized_path += child->randomized_name.empty() ? component : child->randomized_name;
+        if (!child->randomized_name.empty()) {
+            callback(std::string_view(path), std::string_view(randomized_path));
+        }
+        Walk(*child, path, randomized_path, callback);
+        path.resize(length);
+        randomized_path.resize(randomized_length);
+    }
+}
+
+#endif // PATH_TREE_H
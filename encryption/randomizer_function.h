@@ -2,6 +2,7 @@
 #define RANDOMIZER_FUNCTION_H
 
 #include "helpers/json.hpp"
+#include "encryption/metadata_index.h"
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
@@ -9,6 +10,8 @@
 #include <string>
 #include <stdexcept>
 #include <filesystem>
+#include <utility>
+#include <vector>
 
 namespace fs = std::filesystem;
 using json = nlohmann::json;
@@ -19,10 +22,16 @@ public:
     static json ReadMetadata(const std::string& path_to_metadata);
     static std::string GetFilename(const std::string& randomized_name, const std::string& path_to_metadata);
     static std::string GetRandomizedName(const std::string& filename, const std::string& path_to_metadata);
+    static std::vector<std::string> GetFilenames(const std::vector<std::string>& randomized_names, const std::string& path_to_metadata);
+    static std::vector<std::string> GetRandomizedNames(const std::vector<std::string>& filenames, const std::string& path_to_metadata);
     static std::string GetRandomizedFilePath(const std::string& filepath, const std::string& path_to_metadata);
     static std::string GetPlaintextFilePath(const std::string& randomized_filepath, const std::string& path_to_metadata);
     static std::string EncryptFilename(const std::string& filename, const std::string& path_to_metadata);
     static std::string DecryptFilename(const std::string& randomized_name, const std::string& path_to_metadata);
+    static DirectoryTable GetDirectoryTable(const std::string& directory_path, const std::string& path_to_metadata);
+    static uint64_t MetadataGeneration(const std::string& path_to_metadata);
+    static size_t CountEntriesUnder(const std::string& directory_path, const std::string& path_to_metadata);
+    static std::vector<std::pair<std::string, std::string>> ListEntriesUnder(const std::string& directory_path, const std::string& path_to_metadata);
 
 private:
     static std::string GenerateRandomString(int length);
@@ -48,60 +57,75 @@ std::string FilenameRandomizer::GenerateRandomString(int length) {
 }
 
 json FilenameRandomizer::ReadMetadata(const std::string& path_to_metadata) {
-    fs::path metadata_path = fs::path(path_to_metadata) / "common" / "structure.json";
-    std::ifstream metadata_file(metadata_path);
-    if (!metadata_file.is_open()) {
-        throw std::runtime_error("Failed to open structure.json file");
-    }
-
-    json metadata_json = json::parse(metadata_file);
-    return metadata_json;
+    return MetadataIndex::Instance(path_to_metadata).ToJson();
 }
 
 std::string FilenameRandomizer::GetFilename(const std::string& randomized_name, const std::string& path_to_metadata) {
-    json metadata_json = ReadMetadata(path_to_metadata);
-    if (metadata_json.find(randomized_name) == metadata_json.end()) {
+    std::string_view decrypted_name = MetadataIndex::Instance(path_to_metadata).FindPlaintext(randomized_name);
+    if (decrypted_name.empty()) {
         return "";
     }
-    std::string decrypted_name = metadata_json[randomized_name];
     return fs::path(decrypted_name).filename();
 }
 
 std::string FilenameRandomizer::GetRandomizedName(const std::string& filename, const std::string& path_to_metadata) {
-    json obj = ReadMetadata(path_to_metadata);
-    for (auto& [key, value] : obj.items()) {
-        if (value == filename) {
-            return key;
-        }
+    return std::string(MetadataIndex::Instance(path_to_metadata).FindRandomized(filename));
+}
+
+// Batch lookups resolve the metadata index once for the whole list instead of once per name.
+std::vector<std::string> FilenameRandomizer::GetFilenames(const std::vector<std::string>& randomized_names, const std::string& path_to_metadata) {
+    const MetadataIndex& index = MetadataIndex::Instance(path_to_metadata);
+    std::vector<std::string> filenames;
+    filenames.reserve(randomized_names.size());
+    for (const std::string& randomized_name : randomized_names) {
+        filenames.emplace_back(MetadataSnapshot::NameOf(index.FindPlaintext(randomized_name)));
+    }
+    return filenames;
+}
+
+std::vector<std::string> FilenameRandomizer::GetRandomizedNames(const std::vector<std::string>& filenames, const std::string& path_to_metadata) {
+    const MetadataIndex& index = MetadataIndex::Instance(path_to_metadata);
+    std::vector<std::string> randomized_names;
+    randomized_names.reserve(filenames.size());
+    for (const std::string& filename : filenames) {
+        randomized_names.emplace_back(index.FindRandomized(filename));
     }
-    return "";
+    return randomized_names;
 }
 
 std::string FilenameRandomizer::GetRandomizedFilePath(const std::string& filepath, const std::string& path_to_metadata) {
-    fs::path path(filepath);
+    std::vector<std::string> parts;
+    for (const auto& part : fs::path(filepath)) {
+        parts.push_back(part.string());
+    }
+
     fs::path randomized_path;
-    for (const auto& part : path) {
-        randomized_path /= GetRandomizedName(part.string(), path_to_metadata);
+    for (const std::string& randomized_name : GetRandomizedNames(parts, path_to_metadata)) {
+        randomized_path /= randomized_name;
     }
     return randomized_path.string();
 }
 
 std::string FilenameRandomizer::GetPlaintextFilePath(const std::string& randomized_filepath, const std::string& path_to_metadata) {
-    fs::path path(randomized_filepath);
+    std::vector<std::string> parts;
+    for (const auto& part : fs::path(randomized_filepath)) {
+        parts.push_back(part.string());
+    }
+
     fs::path plaintext_path;
-    for (const auto& part : path) {
-        plaintext_path /= GetFilename(part.string(), path_to_metadata);
+    for (const std::string& filename : GetFilenames(parts, path_to_metadata)) {
+        plaintext_path /= filename;
     }
     return plaintext_path.string();
 }
 
 std::string FilenameRandomizer::EncryptFilename(const std::string& filename, const std::string& path_to_metadata) {
-    std::string randomized_filename = GenerateRandomString(10);
-    json metadata_json = ReadMetadata(path_to_metadata);
-    metadata_json[randomized_filename] = filename;
-    fs::path metadata_path = fs::path(path_to_metadata) / "common" / "structure.json";
-    std::ofstream file(metadata_path);
-    file << metadata_json.dump(4);
+    MetadataIndex& index = MetadataIndex::Instance(path_to_metadata);
+    std::string randomized_filename;
+    do {
+        randomized_filename = GenerateRandomString(10);
+    } while (!index.FindPlaintext(randomized_filename).empty());
+    index.Add(randomized_filename, filename);
     return randomized_filename;
 }
 
@@ -109,4 +133,28 @@ std::string FilenameRandomizer::DecryptFilename(const std::string& randomized_na
     return GetFilename(randomized_name, path_to_metadata);
 }
 
+DirectoryTable FilenameRandomizer::GetDirectoryTable(const std::string& directory_path, const std::string& path_to_metadata) {
+    return MetadataIndex::Instance(path_to_metadata).LoadDirectory(directory_path);
+}
+
+uint64_t FilenameRandomizer::MetadataGeneration(const std::string& path_to_metadata) {
+    return MetadataIndex::Instance(path_to_metadata).Generation();
+}
+
+// Counts the files and directories anywhere below directory_path, which is spelled out in
+// plaintext, e.g. "/filesystem/bob/personal/projects".
+size_t FilenameRandomizer::CountEntriesUnder(const std::string& directory_path, const std::string& path_to_metadata) {
+    return MetadataIndex::Instance(path_to_metadata).Tree().CountSubtree(directory_path);
+}
+
+// Lists the same entries as CountEntriesUnder, as (plaintext path, randomized path) pairs, e.g.
+// ("/filesystem/bob/personal/notes", "/filesystem/<bob>/<personal>/<notes>").
+std::vector<std::pair<std::string, std::string>> FilenameRandomizer::ListEntriesUnder(const std::string& directory_path, const std::string& path_to_metadata) {
+    std::vector<std::pair<std::string, std::string>> entries;
+    MetadataIndex::Instance(path_to_metadata).Tree().ForEachInSubtree(directory_path, [&](std::string_view path, std::string_view randomized_path) {
+        entries.emplace_back(path, randomized_path);
+    });
+    return entries;
+}
+
 #endif // RANDOMIZER_FUNCTION_H
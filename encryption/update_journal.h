@@ -0,0 +1,266 @@
+/*
+* Update journal: redo log that makes an in-place update of an encrypted file all or nothing.
+*
+* The journal of <dir>/<name> is the hidden file <dir>/.<name>.journal. An update appends to
+* it every write it will make inside the file's old extent, then a trailer with the guard (the
+* bytes the update replaces at one offset, the file's metadata block), the file's new size
+* and a SHA-256 of everything before it, and syncs it. Only then are the writes applied to the
+* file, which is synced before the journal is removed.
+*
+* Layout (native byte order):
+*   entries, each a JournalEntry followed by length bytes to write at offset
+*   JournalTrailer
+*
+* recover() runs before a file is read or updated. A journal whose checksum fails was cut
+* short before the update touched the file, and is dropped. A complete one is applied again
+* if the file still holds the old guard or the new bytes at its offset, so a crash at any
+* point leaves either the old or the new version of the file. A journal the file no longer
+* matches is left over from an update whose removal was lost, and is dropped.
+*/
+
+#ifndef UPDATE_JOURNAL_H
+#define UPDATE_JOURNAL_H
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "helpers/posix_file.h"
+
+struct JournalEntry {
+    uint64_t offset;
+    uint64_t length;
+};
+static_assert(sizeof(JournalEntry) == 16, "JournalEntry must stay packed");
+
+struct JournalTrailer {
+    char magic[8];
+    uint64_t new_size;
+    uint64_t guard_offset;
+    uint32_t guard_length;
+    uint32_t entry_count;
+    uint8_t guard[128];
+    uint8_t checksum[32];
+};
+static_assert(sizeof(JournalTrailer) == 192, "JournalTrailer must stay packed");
+
+class UpdateJournal {
+public:
+    static constexpr char kMagic[8] = {'E', 'F', 'S', 'J', 'R', 'N', 'L', '\0'};
+    static constexpr size_t kMaxGuardSize = sizeof(JournalTrailer::guard);
+
+    UpdateJournal() = default;
+    ~UpdateJournal() { EVP_MD_CTX_free(hash_); }
+
+    UpdateJournal(const UpdateJournal&) = delete;
+    UpdateJournal& operator=(const UpdateJournal&) = delete;
+
+    /// Where the journal of filePath lives
+    static std::string pathFor(const std::string& filePath);
+
+    /// Start a journal for filePath, replacing any left over
+    /// \return False if it could not be created
+    bool begin(const std::string& filePath);
+
+    /// Record length bytes to write at offset
+    bool add(uint64_t offset, const void* data, size_t length);
+
+    /// Finish the journal and sync it, making the update durable. Nothing is written to the
+    /// file itself.
+    /// \param guard      The guardLength bytes the file holds at guardOffset before the update
+    /// \param newSize    Size to cut the file to, if it is larger once the writes are applied
+    bool commit(uint64_t guardOffset, const void* guard, size_t guardLength, uint64_t newSize);
+
+    /// Apply a committed journal to file, opened for update, sync it and remove the journal
+    bool apply(PosixFile& file);
+
+    /// Throw away the journal
+    void discard();
+
+    /// Finish or drop an update of filePath cut short by a crash
+    /// \return False if a complete update could not be applied; the journal is kept
+    static bool recover(const std::string& filePath);
+
+private:
+    static bool syncDirectory(const std::string& filePath);
+    bool append(const void* data, size_t length);
+    static bool applyEntries(const PosixFile& journal, uint64_t entriesEnd, PosixFile& file, uint64_t& count);
+
+    std::string journalPath_;
+    PosixFile journal_;
+    EVP_MD_CTX* hash_ = nullptr;
+    JournalTrailer trailer_{};
+    bool ok_ = false;
+};
+
+std::string UpdateJournal::pathFor(const std::string& filePath) {
+    std::filesystem::path path(filePath);
+    return (path.parent_path() / ("." + path.filename().string() + ".journal")).string();
+}
+
+bool UpdateJournal::begin(const std::string& filePath) {
+    journalPath_ = pathFor(filePath);
+    trailer_ = JournalTrailer{};
+    std::memcpy(trailer_.magic, kMagic, sizeof(kMagic));
+    if (hash_ == nullptr) {
+        hash_ = EVP_MD_CTX_new();
+    }
+    ok_ = hash_ != nullptr && 1 == EVP_DigestInit_ex(hash_, EVP_sha256(), nullptr) && journal_.openForWrite(journalPath_);
+    return ok_;
+}
+
+bool UpdateJournal::append(const void* data, size_t length) {
+    ok_ = ok_ && 1 == EVP_DigestUpdate(hash_, data, length) && journal_.append(data, length);
+    return ok_;
+}
+
+bool UpdateJournal::add(uint64_t offset, const void* data, size_t length) {
+    JournalEntry entry{offset, length};
+    ++trailer_.entry_count;
+    return append(&entry, sizeof(entry)) && append(data, length);
+}
+
+bool UpdateJournal::commit(uint64_t guardOffset, const void* guard, size_t guardLength, uint64_t newSize) {
+    if (guardLength > kMaxGuardSize) {
+        return false;
+    }
+    trailer_.new_size = newSize;
+    trailer_.guard_offset = guardOffset;
+    trailer_.guard_length = static_cast<uint32_t>(guardLength);
+    std::memcpy(trailer_.guard, guard, guardLength);
+    unsigned int length = 0;
+    ok_ = ok_ && 1 == EVP_DigestUpdate(hash_, &trailer_, offsetof(JournalTrailer, checksum)) &&
+          1 == EVP_DigestFinal_ex(hash_, trailer_.checksum, &length) &&
+          journal_.append(&trailer_, sizeof(trailer_)) && journal_.sync() && syncDirectory(journalPath_);
+    return ok_;
+}
+
+bool UpdateJournal::apply(PosixFile& file) {
+    // The journal was opened write-only; its entries are read back from the page cache.
+    uint64_t count = 0, end = 0;
+    uint64_t fileSize = 0;
+    bool applied = ok_ && journal_.openForRead(journalPath_) && journal_.size(end) &&
+                   applyEntries(journal_, end - sizeof(JournalTrailer), file, count) && count == trailer_.entry_count && file.size(fileSize) &&
+                   (fileSize <= trailer_.new_size || file.truncate(trailer_.new_size)) && file.sync();
+    if (applied) {
+        discard();
+    }
+    return applied;
+}
+
+void UpdateJournal::discard() {
+    journal_.close();
+    if (!journalPath_.empty()) {
+        ::unlink(journalPath_.c_str());
+    }
+    ok_ = false;
+}
+
+// Copies every entry of journal, whose entries end at entriesEnd, into file.
+bool UpdateJournal::applyEntries(const PosixFile& journal, uint64_t entriesEnd, PosixFile& file, uint64_t& count) {
+    std::vector<unsigned char> buffer;
+    count = 0;
+    for (uint64_t position = 0; position < entriesEnd; ++count) {
+        JournalEntry entry{};
+        if (entriesEnd - position < sizeof(entry) || !journal.readAt(&entry, sizeof(entry), position)) {
+            return false;
+        }
+        position += sizeof(entry);
+        if (entry.length > entriesEnd - position) {
+            return false;
+        }
+        buffer.resize(entry.length);
+        if (!journal.readAt(buffer.data(), buffer.size(), position) || !file.writeAt(buffer.data(), buffer.size(), entry.offset)) {
+            return false;
+        }
+        position += entry.length;
+    }
+    return true;
+}
+
+bool UpdateJournal::recover(const std::string& filePath) {
+    std::string journalPath = pathFor(filePath);
+    PosixFile journal;
+    if (!journal.openForRead(journalPath)) {
+        return true;
+    }
+
+    uint64_t size = 0;
+    JournalTrailer trailer{};
+    bool complete = journal.size(size) && size >= sizeof(trailer) && journal.readAt(&trailer, sizeof(trailer), size - sizeof(trailer)) &&
+                    std::memcmp(trailer.magic, kMagic, sizeof(kMagic)) == 0 && trailer.guard_length <= kMaxGuardSize;
+    EVP_MD_CTX* hash = complete ? EVP_MD_CTX_new() : nullptr;
+    complete = hash != nullptr && 1 == EVP_DigestInit_ex(hash, EVP_sha256(), nullptr);
+    std::vector<unsigned char> buffer(1024 * 1024);
+    uint64_t hashed = size - sizeof(trailer.checksum);
+    for (uint64_t position = 0; complete && position < hashed;) {
+        size_t length = static_cast<size_t>(std::min<uint64_t>(buffer.size(), hashed - position));
+        complete = journal.readAt(buffer.data(), length, position) && 1 == EVP_DigestUpdate(hash, buffer.data(), length);
+        position += length;
+    }
+    uint8_t checksum[sizeof(trailer.checksum)];
+    unsigned int length = 0;
+    complete = complete && 1 == EVP_DigestFinal_ex(hash, checksum, &length) &&
+               CRYPTO_memcmp(checksum, trailer.checksum, sizeof(checksum)) == 0;
+    EVP_MD_CTX_free(hash);
+
+    if (!complete) {
+        journal.close();
+        ::unlink(journalPath.c_str());
+        return true;
+    }
+
+    // The file must hold the bytes the update replaces, or the ones it writes there.
+    PosixFile file;
+    std::vector<unsigned char> current(trailer.guard_length), updated(trailer.guard_length);
+    if (!file.openForUpdate(filePath) || !file.readAt(current.data(), current.size(), trailer.guard_offset)) {
+        return false;
+    }
+    bool matches = std::memcmp(current.data(), trailer.guard, current.size()) == 0;
+    for (uint64_t position = 0; !matches && position + sizeof(JournalEntry) <= size - sizeof(trailer);) {
+        JournalEntry entry{};
+        if (!journal.readAt(&entry, sizeof(entry), position)) {
+            break;
+        }
+        position += sizeof(entry);
+        if (entry.offset == trailer.guard_offset && entry.length == trailer.guard_length &&
+            journal.readAt(updated.data(), updated.size(), position)) {
+            matches = updated == current;
+        }
+        position += entry.length;
+    }
+
+    if (matches) {
+        uint64_t count = 0, fileSize = 0;
+        if (!applyEntries(journal, size - sizeof(trailer), file, count) || count != trailer.entry_count || !file.size(fileSize) ||
+            (fileSize > trailer.new_size && !file.truncate(trailer.new_size)) || !file.sync()) {
+            return false;
+        }
+    }
+    journal.close();
+    ::unlink(journalPath.c_str());
+    return true;
+}
+
+bool UpdateJournal::syncDirectory(const std::string& filePath) {
+    std::string directory = std::filesystem::path(filePath).parent_path().string();
+    PosixFile handle;
+    if (!handle.openForRead(directory.empty() ? "." : directory)) {
+        return false;
+    }
+    int result;
+    do {
+        result = ::fsync(handle.descriptor());
+    } while (result != 0 && errno == EINTR);
+    return result == 0;
+}
+
+#endif // UPDATE_JOURNAL_H
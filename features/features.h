@@ -1,13 +1,15 @@
 /*
 * File and Directory Management: Handles operations such as cd, ls, cat, mkdir, mkfile, 
-* and share within the constraints of the encrypted filesystem.
+* append and share within the constraints of the encrypted filesystem.
 */
 
 #ifndef FEATURES_H
 #define FEATURES_H
 
 #include <cstdlib>
+#include <ctime>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <string>
 #include <unistd.h>
@@ -154,11 +156,47 @@ void handleChangeDirectory(std::string& directoryName, fs::path& rootPath, const
     }
 }
 
+/**
+ * Key that decrypts the files in the current directory: the user's own key, or for the admin
+ * the key of the user whose directory it is.
+ * @return Null at the admin's root, where there are no files
+ */
+const std::vector<uint8_t>* keyForCurrentDirectory(std::string filesystemPath, UserType userType, const std::vector<uint8_t>& key) {
+    if (userType != UserType::admin) {
+        return &key;
+    }
+    std::string pwd = decryptFilePath(getCustomPWD(filesystemPath), filesystemPath);
+    std::string userForKey = getUsernameFromPath(pwd);
+    if (userForKey.empty()) {
+        return nullptr;
+    }
+    const std::vector<uint8_t>& ownerKey = readEncKeyFromMetadata(userForKey, filesystemPath + "/common/");
+    return ownerKey.empty() ? nullptr : &ownerKey;
+}
+
+/**
+ * Size and last modification time of a file, as ls -l shows them
+ * @param info What Encryption::statFile read from the file's header
+ */
+std::string formatFileDetails(const FileInfo& info) {
+    std::time_t modified = static_cast<std::time_t>(info.modified_ns / 1000000000);
+    std::tm local{};
+    char date[32] = "";
+    if (localtime_r(&modified, &local) != nullptr) {
+        std::strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &local);
+    }
+    return std::to_string(info.size) + " " + date;
+}
+
 /**
  * Shows content of current directory
  * @param filesystemPath The base path of the filesystem
+ * @param details Also show each file's size and modification time, read from its header, or
+ *                "unreadable" for a file whose header cannot be read
+ * @param userType User type.
+ * @param key The encryption key of the logged in user.
  */
-void listDirectoryContents(std::string filesystemPath) {
+void listDirectoryContents(std::string filesystemPath, bool details, UserType userType, const std::vector<uint8_t>& key) {
     std::string path = fs::current_path();
     std::cout << "d -> ." << std::endl;
 
@@ -166,6 +204,8 @@ void listDirectoryContents(std::string filesystemPath) {
         std::cout << "d -> .." << std::endl;
     }
 
+    DirectoryTable names = FilenameRandomizer::GetDirectoryTable(getCustomPWD(filesystemPath), filesystemPath);
+    const std::vector<uint8_t>* fileKey = details ? keyForCurrentDirectory(filesystemPath, userType, key) : nullptr;
     for (const fs::directory_entry& entry : fs::directory_iterator(path)) {
         std::string entryPath = entry.path().filename().string();
 
@@ -174,12 +214,21 @@ void listDirectoryContents(std::string filesystemPath) {
         }
 
         fs::file_status status = entry.status();
-        std::string decryptedName = FilenameRandomizer::DecryptFilename(entryPath, filesystemPath);
+        auto name = names.find(entryPath);
+        std::string decryptedName = name != names.end() ? name->second : "";
 
         if (status.type() == fs::file_type::directory) {
             std::cout << "d -> " << decryptedName << std::endl;
         } else if (status.type() == fs::file_type::regular) {
-            std::cout << "f -> " << decryptedName << std::endl;
+            std::cout << "f -> " << decryptedName;
+            FileInfo info;
+            if (fileKey != nullptr && Encryption::statFile(entry.path().string(), *fileKey, info)) {
+                std::cout << " " << formatFileDetails(info);
+            } else if (fileKey != nullptr) {
+                // One damaged file should not end the listing, or the session
+                std::cout << " unreadable";
+            }
+            std::cout << std::endl;
         }
     }
 }
@@ -216,7 +265,7 @@ void addContentsToFile(std::string filename, std::string filepath, std::string c
  * @param filesystemPath The base path of the filesystem where the file is located.
  * @param loggedUsername The username of the user who is sharing the file.
  */
-void shareFile(std::vector<uint8_t> key, std::string username, std::string filename, std::string filesystemPath, std::string loggedUsername) {
+void shareFile(const std::vector<uint8_t>& key, std::string username, std::string filename, std::string filesystemPath, std::string loggedUsername) {
     std::string randomizedFilename = FilenameRandomizer::GetRandomizedName(getCustomPWD(filesystemPath) + "/" + filename, filesystemPath);
 
     if (!doesFileExist(randomizedFilename) || !doesUserExist(username, filesystemPath)) {
@@ -225,12 +274,12 @@ void shareFile(std::vector<uint8_t> key, std::string username, std::string filen
 
     std::string randomizedUserDirectory = getRandomizedUserDirectory(username, filesystemPath);
     std::string randomizedSharedDirectory = getRandomizedSharedDirectory(randomizedUserDirectory, filesystemPath);
-    std::string content = Encryption::decryptFile(randomizedFilename, key);
-    std::vector<uint8_t> shareKey = readEncKeyFromMetadata(username, filesystemPath + "/common/");
+    const std::vector<uint8_t>& shareKey = readEncKeyFromMetadata(username, filesystemPath + "/common/");
     std::string filenameKey = "/filesystem/" + randomizedUserDirectory + "/" + randomizedSharedDirectory + "/" + loggedUsername + "-" + filename;
     std::string sharedRandomizedFilename = FilenameRandomizer::EncryptFilename(filenameKey, filesystemPath);
     std::string shareUserPath = filesystemPath + "/filesystem/" + randomizedUserDirectory + "/" + randomizedSharedDirectory + "/" + sharedRandomizedFilename;
-    Encryption::encryptFile(shareUserPath, content, shareKey);
+    // The recipient gets a link carrying the file's data key, not a re-encrypted copy
+    Encryption::shareFile(randomizedFilename, key, shareUserPath, shareKey);
 
     std::string sharedDataPath = filesystemPath + "/shared";
     std::string sharedDataContent = username + ":" + filenameKey;
@@ -241,19 +290,26 @@ void shareFile(std::vector<uint8_t> key, std::string username, std::string filen
 /**
  * Shows file contents based on user access.
  *
- * @param inputStream Filename to access.
+ * @param inputStream Filename to access, optionally followed by a byte offset and length to
+ *                    show only that part of the file.
  * @param filesystemPath The base path of the filesystem.
  * @param userType User type.
  * @param key The encryption key used for decrypting the file content.
  */
-void processFileAccess(std::istringstream& inputStream, std::string filesystemPath, UserType userType, std::vector<uint8_t> key) {
-    std::string filename;
-    inputStream >> filename;
+void processFileAccess(std::istringstream& inputStream, std::string filesystemPath, UserType userType, const std::vector<uint8_t>& key) {
+    std::string filename, offsetArg, lengthArg;
+    inputStream >> filename >> offsetArg >> lengthArg;
 
     if (filename.empty()) {
         std::cout << "File name not provided" << std::endl;
         return;
     }
+    bool isRange = !offsetArg.empty();
+    uint64_t offset = 0, length = 0;
+    if (isRange && (!parseByteCount(offsetArg, offset) || !parseByteCount(lengthArg, length))) {
+        std::cout << "Invalid range" << std::endl;
+        return;
+    }
     if (filename.find('/') != std::string::npos) {
         std::cout << "File name cannot contain '/'" << std::endl;
         return;
@@ -271,13 +327,16 @@ void processFileAccess(std::istringstream& inputStream, std::string filesystemPa
         return;
     }
 
-    if (userType == UserType::admin) {
-        std::string pwd = decryptFilePath(getCustomPWD(filesystemPath), filesystemPath);
-        std::string userForKey = getUsernameFromPath(pwd);
-        std::vector<uint8_t> userKey = readEncKeyFromMetadata(userForKey, filesystemPath + "/common/");
-        std::cout << Encryption::decryptFile(encryptedName, userKey) << std::endl;
+    const std::vector<uint8_t>* fileKey = keyForCurrentDirectory(filesystemPath, userType, key);
+    if (fileKey == nullptr) {
+        std::cerr << "File does not exist" << std::endl;
+        return;
+    }
+    if (isRange) {
+        std::cout << Encryption::readRange(encryptedName, offset, length, *fileKey) << std::endl;
     } else {
-        std::cout << Encryption::decryptFile(encryptedName, key) << std::endl;
+        Encryption::decryptStream(encryptedName, *fileKey, std::cout);
+        std::cout << std::endl;
     }
 }
 
@@ -289,7 +348,7 @@ void processFileAccess(std::istringstream& inputStream, std::string filesystemPa
  * @param key The encryption key for the file to be shared.
  * @param filesystemPath The base filesystem path.
  */
-void handleFileSharing(std::istringstream& inputStream, std::string userName, std::vector<uint8_t> key, std::string filesystemPath) {
+void handleFileSharing(std::istringstream& inputStream, std::string userName, const std::vector<uint8_t>& key, std::string filesystemPath) {
     std::string filename, shareUsername;
     inputStream >> filename >> shareUsername;
 
@@ -369,6 +428,22 @@ void processCreateDirectoryInUserSpace(std::string directoryName, std::string fi
     }
 }
 
+/**
+ * Reads the arguments of mkfile and append: a filename, then everything after it on the line
+ *
+ * @param inputStream The input stream to extract the filename and contents from.
+ * @param filename Receives the filename.
+ * @param contents Receives the contents.
+ */
+void readFilenameAndContents(std::istringstream& inputStream, std::string& filename, std::string& contents) {
+    inputStream >> filename;
+    std::getline(inputStream, contents);
+    // Drop the space separating the filename from the contents
+    if (!contents.empty() && contents[0] == ' ') {
+        contents.erase(0, 1);
+    }
+}
+
 /**
  * Creates new file
  *
@@ -377,10 +452,9 @@ void processCreateDirectoryInUserSpace(std::string directoryName, std::string fi
  * @param key The encryption key for the file.
  * @param filesystemPath The base path of the filesystem.
  */
-void processFileCreation(std::istringstream& inputStream, std::string userName, std::vector<uint8_t> key, std::string filesystemPath) {
+void processFileCreation(std::istringstream& inputStream, std::string userName, const std::vector<uint8_t>& key, std::string filesystemPath) {
     std::string filename, contents;
-    inputStream >> filename;
-    std::getline(inputStream, contents);
+    readFilenameAndContents(inputStream, filename, contents);
 
     if (filename.find('/') != std::string::npos) {
         std::cout << "File name cannot contain '/'" << std::endl;
@@ -400,6 +474,60 @@ void processFileCreation(std::istringstream& inputStream, std::string userName,
     }
 }
 
+/**
+ * Creates new file from a file on the host, streaming it in without holding it in memory
+ *
+ * @param inputStream The input stream to extract the filename and host path from; a relative
+ *                    host path is taken from the directory the filesystem lives in.
+ * @param userName The name of the user attempting to create the file.
+ * @param key The encryption key for the file.
+ * @param filesystemPath The base path of the filesystem.
+ */
+void processFileImport(std::istringstream& inputStream, std::string userName, const std::vector<uint8_t>& key, std::string filesystemPath) {
+    std::string filename, hostPath;
+    readFilenameAndContents(inputStream, filename, hostPath);
+
+    if (filename.empty() || hostPath.empty()) {
+        std::cout << "Usage: import <filename> <host path>" << std::endl;
+        return;
+    }
+    if (!isValidFilename(filename)) {
+        std::cerr << "Not a valid filename, try again." << std::endl;
+        return;
+    }
+
+    fs::path source = fs::path(filesystemPath) / hostPath;
+    PosixFile input;
+    if (!fs::is_regular_file(source) || !input.openForRead(source.string())) {
+        std::cerr << "Cannot read " << hostPath << std::endl;
+        return;
+    }
+    importEncryptedFile(filename, input, key, filesystemPath, userName);
+}
+
+/**
+ * Adds contents to the end of an existing file
+ *
+ * @param inputStream The input stream to extract the filename and contents from.
+ * @param userName The name of the user appending to the file.
+ * @param key The encryption key for the file.
+ * @param filesystemPath The base path of the filesystem.
+ */
+void processFileAppend(std::istringstream& inputStream, std::string userName, const std::vector<uint8_t>& key, std::string filesystemPath) {
+    std::string filename, contents;
+    readFilenameAndContents(inputStream, filename, contents);
+
+    if (filename.empty()) {
+        std::cout << "File name not provided" << std::endl;
+        return;
+    }
+    if (filename.find('/') != std::string::npos) {
+        std::cout << "File name cannot contain '/'" << std::endl;
+        return;
+    }
+    appendToEncryptedFile(filename, contents, key, filesystemPath, userName);
+}
+
 /**
  * Admin adds new user
  *
@@ -417,7 +545,36 @@ void processAddUser(std::istringstream& inputStream, std::string filesystemPath)
     addUser(newUser, filesystemPath, false);
 }
 
-int userFeatures(std::string user_name, UserType user_type, std::vector<uint8_t> key, std::string filesystemPath) {
+/**
+ * Admin lists every user with the number of files and directories they hold and the total
+ * size of their files. Entries come from the metadata's path tree, so no user directory is
+ * walked; sizes are read from each file's header. Files shared with a user count toward their
+ * owner's size only.
+ *
+ * @param filesystemPath The base path of the filesystem.
+ */
+void processListUsers(std::string filesystemPath) {
+    DirectoryTable users = FilenameRandomizer::GetDirectoryTable("/filesystem", filesystemPath);
+    std::map<std::string, std::pair<size_t, uint64_t>> totals;
+    for (const auto& [randomizedName, username] : users) {
+        std::string userPath = "/filesystem/" + username;
+        uint64_t size = 0;
+        const std::vector<uint8_t>& userKey = readEncKeyFromMetadata(username, filesystemPath + "/common/");
+        for (const auto& [path, randomizedPath] : FilenameRandomizer::ListEntriesUnder(userPath, filesystemPath)) {
+            FileInfo info;
+            std::string filePath = filesystemPath + randomizedPath;
+            if (!userKey.empty() && fs::is_regular_file(filePath) && Encryption::statFile(filePath, userKey, info) && !info.linked) {
+                size += info.size;
+            }
+        }
+        totals[username] = {FilenameRandomizer::CountEntriesUnder(userPath, filesystemPath), size};
+    }
+    for (const auto& [username, total] : totals) {
+        std::cout << username << " " << total.first << " " << total.second << std::endl;
+    }
+}
+
+int userFeatures(std::string user_name, UserType user_type, const std::vector<uint8_t>& key, std::string filesystemPath) {
   std::cout << "++++++++++++++++++++++++" << std::endl;
   std::cout << "++| WELCOME TO EFS! |++" << std::endl;
   std::cout << "++++++++++++++++++++++++" << std::endl;
@@ -425,15 +582,18 @@ int userFeatures(std::string user_name, UserType user_type, std::vector<uint8_t>
 
   std::cout << "cd <directory> \n"
           "pwd \n"
-          "ls  \n"
-          "cat <filename> \n"
+          "ls [-l] \n"
+          "cat <filename> [<offset> <length>] \n"
           "share <filename> <username> \n"
           "mkdir <directory_name> \n"
           "mkfile <filename> <contents> \n"
+          "append <filename> <contents> \n"
+          "import <filename> <host path> \n"
           "exit \n";
 
   if (user_type == admin) {
     std::cout << "adduser <username>" << std::endl;
+    std::cout << "users" << std::endl;
     std::cout << "++++++++++++++++++++++++" << std::endl;
     rootPath = adminRootPath;
   } else if (user_type == user) {
@@ -465,7 +625,13 @@ int userFeatures(std::string user_name, UserType user_type, std::vector<uint8_t>
     } else if (cmd == "pwd") {
         printDecryptedCurrentPath(filesystemPath);
     } else if (cmd == "ls") {
-        listDirectoryContents(filesystemPath);
+        std::string option;
+        istring_stream >> option;
+        if (!option.empty() && option != "-l") {
+            std::cout << "Invalid option " << option << std::endl;
+        } else {
+            listDirectoryContents(filesystemPath, option == "-l", user_type, key);
+        }
     } else if (cmd == "cat") {
         processFileAccess(istring_stream, filesystemPath, user_type, key);
     } else if (cmd == "share") {
@@ -475,10 +641,16 @@ int userFeatures(std::string user_name, UserType user_type, std::vector<uint8_t>
         processCreateDirectoryInUserSpace(directoryName, filesystemPath, user_name);
     } else if (cmd == "mkfile") {
         processFileCreation(istring_stream, user_name, key, filesystemPath);
+    } else if (cmd == "append") {
+        processFileAppend(istring_stream, user_name, key, filesystemPath);
+    } else if (cmd == "import") {
+        processFileImport(istring_stream, user_name, key, filesystemPath);
     } else if (cmd == "exit") {
       exit(EXIT_SUCCESS);
     } else if ((cmd == "adduser") && (user_type == admin)) {
         processAddUser(istring_stream, filesystemPath);
+    } else if ((cmd == "users") && (user_type == admin)) {
+        processListUsers(filesystemPath);
     } else {
       std::cout << "Invalid Command" << std::endl;
     }
@@ -17,6 +17,7 @@
 #include "encryption/randomizer_function.h"
 #include "authentication/authentication.h"
 #include "helpers/helper_functions.h"
+#include "helpers/lru_cache.h"
 
 namespace fs = std::filesystem;
 
@@ -24,11 +25,36 @@ fs::path adminRootPath = fs::current_path() / "filesystem";
 fs::path userRootPath = fs::current_path() / "filesystem";
 fs::path rootPath;
 
+// Full-path translations for the prompt, pwd and cd. Every mkdir, mkfile or share adds a
+// name mapping, which bumps the metadata generation and drops both caches.
+const size_t pathCacheCapacity = 1024;
+LruCache<std::string, std::string> decryptedPathCache(pathCacheCapacity);
+LruCache<std::string, std::string> encryptedPathCache(pathCacheCapacity);
+uint64_t pathCacheGeneration = 0;
+
+void syncPathCaches(const std::string& filesystemPath) {
+    uint64_t generation = FilenameRandomizer::MetadataGeneration(filesystemPath);
+    if (generation != pathCacheGeneration) {
+        decryptedPathCache.clear();
+        encryptedPathCache.clear();
+        pathCacheGeneration = generation;
+    }
+}
+
 std::string getCustomPWD(const std::string& basePath) {
     std::string currentPath = fs::current_path().string();
     return currentPath.erase(1, basePath.length());
 }
 
+// Parses a non-negative decimal byte count such as a cat offset or length.
+bool parseByteCount(const std::string& text, uint64_t& value) {
+    if (text.empty() || text.size() > 19 || text.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    value = std::stoull(text);
+    return true;
+}
+
 bool doesFileExist(const std::string& randomizedFilename) {
     if (!fs::exists(randomizedFilename)) {
         std::cout << "File does not exist" << std::endl;
@@ -79,8 +105,12 @@ void parseFileContents(std::ifstream& file, std::vector<std::string>& keys, std:
   }
 }
 
-// Updates shared files with encrypted content for each user specified in the usernames vector
-void updateSharedFiles(std::vector<std::string> keys, std::vector<std::string> usernames, std::string randomizedFilename, std::string filesystemPath, std::string content) {
+// Refreshes the links of every user the file is shared with. Links carry the file's data key,
+// so this re-wraps one key per user instead of re-encrypting the content, and replaces copies
+// made before links existed. All links are written in one batch.
+void updateSharedFiles(std::vector<std::string> keys, std::vector<std::string> usernames, std::string randomizedFilename, std::string filesystemPath, const std::vector<uint8_t>& ownerKey) {
+    std::vector<ShareTarget> targets;
+    targets.reserve(keys.size());
     for (int i = 0; i < keys.size(); i++) {
         std::string key = keys[i];
         std::string sharedRandomizedFilename = FilenameRandomizer::GetRandomizedName(key, filesystemPath);
@@ -89,15 +119,16 @@ void updateSharedFiles(std::vector<std::string> keys, std::vector<std::string> u
         key.erase(lastOccurence + 1, key.length());
 
         std::string shareUserPath = filesystemPath + key + sharedRandomizedFilename;
-        std::vector<uint8_t> shareKey = readEncKeyFromMetadata(usernames[i], filesystemPath + "/common/");
-        
-        // Encrypt the file at the specified path with the provided content using the user's encryption key
-        Encryption::encryptFile(shareUserPath, content, shareKey);
+        const std::vector<uint8_t>& shareKey = readEncKeyFromMetadata(usernames[i], filesystemPath + "/common/");
+        targets.push_back({shareUserPath, shareKey});
+    }
+    if (!targets.empty()) {
+        Encryption::shareFile(randomizedFilename, ownerKey, targets);
     }
 }
 
 // Checks if a file is shared, and if so, updates shared files accordingly.
-void checkIfShared(std::string randomizedFilename, std::string filesystemPath, std::string content) {
+void checkIfShared(std::string randomizedFilename, std::string filesystemPath, const std::vector<uint8_t>& ownerKey) {
   // Construct the filepath to the shared file directory
   std::string filepath = filesystemPath + "/shared/" + randomizedFilename;
 
@@ -107,7 +138,7 @@ void checkIfShared(std::string randomizedFilename, std::string filesystemPath, s
     parseFileContents(file, keys, usernames);
     file.close();
 
-    updateSharedFiles(keys, usernames, randomizedFilename, filesystemPath, content);
+    updateSharedFiles(keys, usernames, randomizedFilename, filesystemPath, ownerKey);
   }
 }
 
@@ -172,13 +203,18 @@ bool isFileSharedWithUser(std::string filename, std::string filesystemPath, std:
 
 std::string getEncFilename(std::string inputFilename, std::string inputPath, std::string filesystemPath, bool isMkdir) {
   int dirItrPath = inputPath.find_last_of('/');
+  DirectoryTable names = FilenameRandomizer::GetDirectoryTable(inputPath.substr(0, dirItrPath), filesystemPath);
   for (fs::directory_entry entry : fs::directory_iterator(filesystemPath + inputPath.substr(0, dirItrPath+1))) {
     std::string entryPath = entry.path();
     int deleteUpto = entryPath.find_last_of('/') + 1;
     entryPath.erase(0, deleteUpto);
 
+    auto name = names.find(entryPath);
+    if (name == names.end()) {
+      continue;
+    }
     fs::file_status status = fs::status(entryPath);
-    std::string decryptedName = FilenameRandomizer::DecryptFilename(entryPath, filesystemPath);
+    const std::string& decryptedName = name->second;
     // Return same path if a file with the same name exists
     if (inputFilename == decryptedName && status.type() == fs::file_type::regular) {
       if (!isMkdir)
@@ -196,8 +232,10 @@ std::string getEncFilename(std::string inputFilename, std::string inputPath, std
   return FilenameRandomizer::EncryptFilename(inputPath, filesystemPath);
 }
 
-// Creates and encrypts a file within the user's personal directory after performing security checks.
-void createAndEncryptFile(std::string filename, std::string contents, std::vector<uint8_t> key, std::string filesystemPath, std::string username) {
+// Creates a file within the user's personal directory after performing security checks;
+// write(encryptedName) encrypts the contents into it.
+template <typename Write>
+void createEncryptedFile(std::string filename, const std::vector<uint8_t>& key, std::string filesystemPath, std::string username, Write&& write) {
   // Ensure the operation is within the user's personal directory
   if (!checkIfPersonalDirectory(username, getCustomPWD(filesystemPath), filesystemPath)) {
     std::cout << "Forbidden " << std::endl;
@@ -216,40 +254,69 @@ void createAndEncryptFile(std::string filename, std::string contents, std::vecto
   std::string encryptedName = getEncFilename(filename, path, filesystemPath, false);
   if (!encryptedName.empty()) {
     // Encrypt and save the file with the encrypted name
-    Encryption::encryptFile(encryptedName, contents, key);
+    write(encryptedName);
     // Check if the file is intended to be shared and handle accordingly
-    checkIfShared(encryptedName, filesystemPath, contents);
+    checkIfShared(encryptedName, filesystemPath, key);
     std::cout << "File created and encrypted successfully!" << std::endl;
   }
 }
 
+// Creates and encrypts a file with the given contents.
+void createAndEncryptFile(std::string filename, std::string contents, const std::vector<uint8_t>& key, std::string filesystemPath, std::string username) {
+  createEncryptedFile(filename, key, filesystemPath, username, [&](const std::string& encryptedName) {
+    Encryption::encryptFile(encryptedName, contents, key);
+  });
+}
+
+// Creates and encrypts a file from input, an open host file, a few chunks at a time, so the
+// file never has to fit in memory.
+void importEncryptedFile(std::string filename, const PosixFile& input, const std::vector<uint8_t>& key, std::string filesystemPath, std::string username) {
+  createEncryptedFile(filename, key, filesystemPath, username, [&](const std::string& encryptedName) {
+    Encryption::encryptStream(input, encryptedName, key);
+  });
+}
+
+// Adds contents to the end of an existing file in the user's personal directory. Only the
+// end of the file is re-encrypted, and users it is shared with see the new contents.
+void appendToEncryptedFile(std::string filename, std::string contents, const std::vector<uint8_t>& key, std::string filesystemPath, std::string username) {
+  if (!checkIfPersonalDirectory(username, getCustomPWD(filesystemPath), filesystemPath)) {
+    std::cout << "Forbidden " << std::endl;
+    return;
+  }
+
+  std::string path = getCustomPWD(filesystemPath) + "/" + filename;
+  std::string encryptedName = FilenameRandomizer::GetRandomizedName(path, filesystemPath);
+  if (!fs::exists(encryptedName) || fs::is_directory(fs::status(encryptedName))) {
+    std::cerr << "File does not exist" << std::endl;
+    return;
+  }
+  Encryption::appendFile(encryptedName, contents, key);
+  checkIfShared(encryptedName, filesystemPath, key);
+  std::cout << "Contents appended successfully!" << std::endl;
+}
+
 // Helper function to process the path and extract/decrypt filenames
 std::vector<std::string> processAndDecryptPath(std::string path, const std::string& filesystemPath) {
     const std::string delimiter = "/";
-    std::vector<std::string> filenames;
+    std::vector<std::string> names;
     size_t pos = 0;
 
     while ((pos = path.find(delimiter)) != std::string::npos) {
-        std::string name = path.substr(0, pos);
-        if (name == "filesystem") {
-            // Add 'filesystem' directly without decryption
-            filenames.push_back(name);
-        } else {
-            // Decrypt the name and add it to the filenames vector
-            std::string decrypted = FilenameRandomizer::GetFilename(name, filesystemPath);
-            filenames.push_back(decrypted);
-        }
+        names.push_back(path.substr(0, pos));
         // Prepare for the next iteration
         path.erase(0, pos + delimiter.length());
     }
 
     // Handle the case where there is a remaining part of the path after the last delimiter
     if (!path.empty()) {
-        if (path == "filesystem") {
-            filenames.push_back(path);
-        } else {
-            std::string decrypted = FilenameRandomizer::GetFilename(path, filesystemPath);
-            filenames.push_back(decrypted);
+        names.push_back(path);
+    }
+
+    // Decrypt every component in one batch; 'filesystem' is kept as is
+    std::vector<std::string> filenames = FilenameRandomizer::GetFilenames(names, filesystemPath);
+    for (size_t i = 0; i < names.size(); i++) {
+        if (names[i] == "filesystem") {
+            filenames[i] = names[i];
         }
     }
 
@@ -257,6 +324,12 @@ std::vector<std::string> processAndDecryptPath(std::string path, const std::stri
 }
 
 std::string decryptFilePath(std::string path, const std::string& filesystemPath) {
+    syncPathCaches(filesystemPath);
+    if (const std::string* cached = decryptedPathCache.get(path)) {
+        return *cached;
+    }
+    const std::string cacheKey = path;
+
     // Normalize the path by removing a leading "/"
     if (!path.empty() && path[0] == '/') {
         path = path.substr(1);
@@ -271,6 +344,7 @@ std::string decryptFilePath(std::string path, const std::string& filesystemPath)
     }
     decryptedFilePath.pop_back();
 
+    decryptedPathCache.put(cacheKey, decryptedFilePath);
     return decryptedFilePath;
 }
 
@@ -280,6 +354,12 @@ std::string getEncryptedFilePath(std::string path, std::string filesystemPath) {
         return path;
     }
     std::string pwd = getCustomPWD(filesystemPath);
+    syncPathCaches(filesystemPath);
+    const std::string cacheKey = pwd + '\n' + path;
+    if (const std::string* cached = encryptedPathCache.get(cacheKey)) {
+        return *cached;
+    }
+
     size_t pos = 0;
     const std::string delimiter = "/";
     std::vector<std::string> filenames;
@@ -318,6 +398,8 @@ std::string getEncryptedFilePath(std::string path, std::string filesystemPath) {
     if (!encryptedFilePath.empty() && encryptedFilePath.back() == '/') {
         encryptedFilePath.pop_back();
     }
+
+    encryptedPathCache.put(cacheKey, encryptedFilePath);
     return encryptedFilePath;
 }
 
@@ -0,0 +1,492 @@
+/*
+* Asynchronous file I/O: reads and writes are queued and carried out in the background while
+* the caller keeps working, with up to a fixed number in flight, and each one can be waited
+* for on its own.
+*
+* On Linux the engine drives an io_uring instance directly through its system calls, and the
+* operations queued since the last wait reach the kernel together. Where io_uring is
+* unavailable (old kernels, seccomp filters such as Docker's default profile), a small pool of
+* I/O threads runs them with pread/pwrite instead. Regular files always poll as ready, so
+* epoll has nothing to offer for them. The I/O threads spend their time blocked in the kernel
+* and are kept apart from the CPU-sized ThreadPool::shared().
+*
+* EFS_ASYNC_IO=threads skips io_uring. EFS_ASYNC_IO=off, like a depth of 0, carries out every
+* operation synchronously as it is queued.
+*
+* Buffers must stay valid and untouched until their operation has been waited for.
+*/
+
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "helpers/thread_pool.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// Pulled in through <linux/fs.h>; encryption.h defines its own BLOCK_SIZE.
+#undef BLOCK_SIZE
+#define ASYNC_IO_HAS_URING 1
+#else
+#define ASYNC_IO_HAS_URING 0
+#endif
+
+class AsyncIo {
+public:
+    enum class Backend { Uring, Threads, Synchronous };
+    using Ticket = uint64_t;
+
+    static constexpr unsigned kDefaultDepth = 64;
+
+    /// \param depth   Operations kept in flight at once; queuing another first waits for one
+    ///                to finish. 0 carries out every operation as it is queued.
+    explicit AsyncIo(unsigned depth = kDefaultDepth);
+    ~AsyncIo();
+
+    AsyncIo(const AsyncIo&) = delete;
+    AsyncIo& operator=(const AsyncIo&) = delete;
+
+    /// Queue a read of exactly length bytes at offset
+    Ticket read(int fd, void* buffer, size_t length, uint64_t offset);
+
+    /// Queue a write of all of length bytes at offset
+    Ticket write(int fd, const void* buffer, size_t length, uint64_t offset);
+
+    /// Wait for one queued operation; each ticket can be waited for once
+    /// \return False if it failed, or the file ended before a read was done
+    bool wait(Ticket ticket);
+
+    /// Wait for every queued operation
+    /// \return False if any of them that was not waited for failed
+    bool drain();
+
+    Backend backend() const { return backend_; }
+
+private:
+    static constexpr size_t kIoThreads = 4;
+
+    struct Operation {
+        bool write;
+        int fd;
+        char* buffer;
+        size_t length;
+        uint64_t offset;
+        Ticket ticket;
+    };
+
+    Ticket queue(Operation operation);
+    void finish(Ticket ticket, bool ok);
+
+    /// Carry out an operation synchronously from where a partial transfer left off
+    static bool complete(Operation operation);
+
+    /// Process-wide pool of I/O threads, started the first time it is needed
+    static ThreadPool& ioThreads();
+
+    bool setupRing(unsigned depth);
+    void destroyRing();
+    /// Hand the queued entries to the kernel and wait for at least minComplete completions
+    bool enter(unsigned minComplete);
+    /// Retire every completion the kernel has posted
+    void reap();
+
+    Backend backend_ = Backend::Synchronous;
+    unsigned depth_ = 0;
+    Ticket next_ = 0;
+    size_t inFlight_ = 0;
+    std::unordered_map<Ticket, bool> finished_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+
+    // io_uring state; ringFd_ is -1 unless backend_ is Backend::Uring
+    int ringFd_ = -1;
+    void* sqRing_ = nullptr;
+    void* cqRing_ = nullptr;
+    size_t sqRingSize_ = 0;
+    size_t cqRingSize_ = 0;
+    void* sqes_ = nullptr;
+    size_t sqesSize_ = 0;
+    unsigned* sqTail_ = nullptr;
+    unsigned* sqMask_ = nullptr;
+    unsigned* sqArray_ = nullptr;
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned* cqMask_ = nullptr;
+    void* cqes_ = nullptr;
+    std::vector<Operation> slots_;
+    std::vector<unsigned> freeSlots_;
+    std::deque<unsigned> unsubmitted_;
+};
+
+/// Reads a file from its start through an AsyncIo, keeping the reads of the blocks after the
+/// one being consumed in flight
+class AsyncReader {
+public:
+    /// \param size        Bytes to read; a file that ends sooner fails
+    /// \param blockSize   Bytes per read
+    /// \param blocks      Reads kept in flight
+    AsyncReader(AsyncIo& io, int fd, uint64_t size, size_t blockSize, size_t blocks);
+    ~AsyncReader() { io_.drain(); }
+
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    /// Copy the next bytes of the file into buffer, as std::istream::read would
+    /// \return Bytes copied, less than capacity only at the end of the file or after a failure
+    size_t read(unsigned char* buffer, size_t capacity);
+
+    bool failed() const { return failed_; }
+
+private:
+    void queue(size_t block);
+
+    AsyncIo& io_;
+    int fd_;
+    uint64_t size_;
+    size_t blockSize_;
+    std::vector<unsigned char> buffer_;
+    std::vector<AsyncIo::Ticket> tickets_;
+    uint64_t queued_ = 0;   // bytes queued so far
+    uint64_t position_ = 0; // bytes handed out so far
+    bool ready_ = false;    // the block holding position_ has been waited for
+    bool failed_ = false;
+};
+
+AsyncIo::AsyncIo(unsigned depth) : depth_(depth) {
+    const char* configured = std::getenv("EFS_ASYNC_IO");
+    std::string mode = configured != nullptr ? configured : "";
+    if (depth == 0 || mode == "off") {
+        backend_ = Backend::Synchronous;
+    } else if (mode != "threads" && setupRing(depth)) {
+        backend_ = Backend::Uring;
+    } else {
+        destroyRing();
+        backend_ = Backend::Threads;
+    }
+}
+
+AsyncIo::~AsyncIo() {
+    drain();
+    destroyRing();
+}
+
+AsyncIo::Ticket AsyncIo::read(int fd, void* buffer, size_t length, uint64_t offset) {
+    return queue(Operation{false, fd, static_cast<char*>(buffer), length, offset, 0});
+}
+
+AsyncIo::Ticket AsyncIo::write(int fd, const void* buffer, size_t length, uint64_t offset) {
+    return queue(Operation{true, fd, const_cast<char*>(static_cast<const char*>(buffer)), length, offset, 0});
+}
+
+bool AsyncIo::complete(Operation operation) {
+    while (operation.length > 0) {
+        ssize_t count = operation.write
+            ? ::pwrite(operation.fd, operation.buffer, operation.length, static_cast<off_t>(operation.offset))
+            : ::pread(operation.fd, operation.buffer, operation.length, static_cast<off_t>(operation.offset));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        operation.buffer += count;
+        operation.length -= static_cast<size_t>(count);
+        operation.offset += static_cast<uint64_t>(count);
+    }
+    return true;
+}
+
+ThreadPool& AsyncIo::ioThreads() {
+    static ThreadPool pool(kIoThreads);
+    return pool;
+}
+
+void AsyncIo::finish(Ticket ticket, bool ok) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_[ticket] = ok;
+    --inFlight_;
+    changed_.notify_all();
+}
+
+AsyncIo::Ticket AsyncIo::queue(Operation operation) {
+    operation.ticket = next_++;
+    if (backend_ == Backend::Synchronous) {
+        finished_[operation.ticket] = complete(operation);
+        return operation.ticket;
+    }
+    if (backend_ == Backend::Threads) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            changed_.wait(lock, [this] { return inFlight_ < depth_; });
+            ++inFlight_;
+        }
+        ioThreads().submit([this, operation] { finish(operation.ticket, complete(operation)); });
+        return operation.ticket;
+    }
+
+#if ASYNC_IO_HAS_URING
+    while (freeSlots_.empty()) {
+        if (!enter(1)) {
+            finished_[operation.ticket] = complete(operation);
+            return operation.ticket;
+        }
+        reap();
+    }
+    unsigned slot = freeSlots_.back();
+    freeSlots_.pop_back();
+    slots_[slot] = operation;
+
+    unsigned tail = *sqTail_;
+    unsigned index = tail & *sqMask_;
+    io_uring_sqe& sqe = static_cast<io_uring_sqe*>(sqes_)[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = operation.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe.fd = operation.fd;
+    sqe.addr = reinterpret_cast<uint64_t>(operation.buffer);
+    sqe.len = static_cast<uint32_t>(std::min<size_t>(operation.length, 1u << 30));
+    sqe.off = operation.offset;
+    sqe.user_data = slot;
+    sqArray_[index] = index;
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted_.push_back(slot);
+    ++inFlight_;
+#endif
+    return operation.ticket;
+}
+
+bool AsyncIo::wait(Ticket ticket) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (finished_.count(ticket) == 0) {
+        if (ticket >= next_ || inFlight_ == 0) {
+            return false;
+        }
+        if (backend_ == Backend::Uring) {
+            lock.unlock();
+            if (enter(1)) {
+                reap();
+            }
+            lock.lock();
+        } else {
+            changed_.wait(lock);
+        }
+    }
+    bool ok = finished_[ticket];
+    finished_.erase(ticket);
+    return ok;
+}
+
+bool AsyncIo::drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (inFlight_ > 0) {
+        if (backend_ == Backend::Uring) {
+            lock.unlock();
+            if (enter(1)) {
+                reap();
+            }
+            lock.lock();
+        } else {
+            changed_.wait(lock);
+        }
+    }
+    bool ok = std::all_of(finished_.begin(), finished_.end(), [](const auto& entry) { return entry.second; });
+    finished_.clear();
+    return ok;
+}
+
+#if ASYNC_IO_HAS_URING
+
+bool AsyncIo::setupRing(unsigned depth) {
+    io_uring_params params{};
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+    if (fd < 0) {
+        return false;
+    }
+    ringFd_ = fd;
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        sqRing_ = nullptr;
+        return false;
+    }
+    if (singleMap) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            cqRing_ = nullptr;
+            return false;
+        }
+    }
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        sqes_ = nullptr;
+        return false;
+    }
+
+    char* sq = static_cast<char*>(sqRing_);
+    char* cq = static_cast<char*>(cqRing_);
+    sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+
+    // The completion queue is at least as large, so it cannot overflow.
+    depth_ = params.sq_entries;
+    slots_.resize(depth_);
+    for (unsigned i = depth_; i-- > 0;) {
+        freeSlots_.push_back(i);
+    }
+    return true;
+}
+
+void AsyncIo::destroyRing() {
+    if (sqes_ != nullptr) {
+        munmap(sqes_, sqesSize_);
+    }
+    if (cqRing_ != nullptr && cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingSize_);
+    }
+    if (sqRing_ != nullptr) {
+        munmap(sqRing_, sqRingSize_);
+    }
+    if (ringFd_ >= 0) {
+        ::close(ringFd_);
+    }
+    sqes_ = sqRing_ = cqRing_ = nullptr;
+    ringFd_ = -1;
+}
+
+// Entries the kernel refuses are taken back off the ring and carried out here instead.
+bool AsyncIo::enter(unsigned minComplete) {
+    for (;;) {
+        unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        long submitted = syscall(__NR_io_uring_enter, ringFd_, static_cast<unsigned>(unsubmitted_.size()), minComplete, flags, nullptr, 0);
+        if (submitted >= 0) {
+            unsubmitted_.erase(unsubmitted_.begin(), unsubmitted_.begin() + std::min<size_t>(submitted, unsubmitted_.size()));
+            if (unsubmitted_.empty() || minComplete == 0) {
+                return true;
+            }
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (unsubmitted_.empty()) {
+            return false;
+        }
+        __atomic_store_n(sqTail_, *sqTail_ - static_cast<unsigned>(unsubmitted_.size()), __ATOMIC_RELEASE);
+        for (unsigned slot : unsubmitted_) {
+            Operation operation = slots_[slot];
+            freeSlots_.push_back(slot);
+            finish(operation.ticket, complete(operation));
+        }
+        unsubmitted_.clear();
+        return false;
+    }
+}
+
+// Operations the kernel only partly did are finished synchronously.
+void AsyncIo::reap() {
+    unsigned head = *cqHead_;
+    while (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+        const io_uring_cqe& cqe = static_cast<const io_uring_cqe*>(cqes_)[head & *cqMask_];
+        unsigned slot = static_cast<unsigned>(cqe.user_data);
+        int result = cqe.res;
+        ++head;
+
+        Operation operation = slots_[slot];
+        freeSlots_.push_back(slot);
+        bool ok;
+        if (result == -EINTR || result == -EAGAIN) {
+            ok = complete(operation);
+        } else if (result < 0 || (result == 0 && operation.length > 0)) {
+            ok = false;
+        } else {
+            operation.buffer += result;
+            operation.length -= static_cast<size_t>(result);
+            operation.offset += static_cast<uint64_t>(result);
+            ok = complete(operation);
+        }
+        finish(operation.ticket, ok);
+    }
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+}
+
+#else
+
+bool AsyncIo::setupRing(unsigned) { return false; }
+void AsyncIo::destroyRing() {}
+bool AsyncIo::enter(unsigned) { return false; }
+void AsyncIo::reap() {}
+
+#endif
+
+AsyncReader::AsyncReader(AsyncIo& io, int fd, uint64_t size, size_t blockSize, size_t blocks)
+    : io_(io), fd_(fd), size_(size), blockSize_(blockSize), buffer_(blockSize * blocks), tickets_(blocks) {
+    for (size_t block = 0; block < blocks; ++block) {
+        queue(block);
+    }
+}
+
+void AsyncReader::queue(size_t block) {
+    if (queued_ < size_) {
+        size_t length = static_cast<size_t>(std::min<uint64_t>(blockSize_, size_ - queued_));
+        tickets_[block] = io_.read(fd_, buffer_.data() + block * blockSize_, length, queued_);
+        queued_ += length;
+    }
+}
+
+// Blocks are used round robin: the one at position_ is slot (position_ / blockSize_) % blocks,
+// and once consumed it is queued again for the next block past the last one queued.
+size_t AsyncReader::read(unsigned char* buffer, size_t capacity) {
+    size_t copied = 0;
+    size_t blocks = tickets_.size();
+    while (copied < capacity && position_ < size_ && !failed_) {
+        size_t block = static_cast<size_t>(position_ / blockSize_ % blocks);
+        if (!ready_) {
+            failed_ = !io_.wait(tickets_[block]);
+            ready_ = true;
+            if (failed_) {
+                break;
+            }
+        }
+        size_t within = static_cast<size_t>(position_ % blockSize_);
+        size_t blockEnd = static_cast<size_t>(std::min<uint64_t>(blockSize_, size_ - (position_ - within)));
+        size_t length = std::min(capacity - copied, blockEnd - within);
+        std::memcpy(buffer + copied, buffer_.data() + block * blockSize_ + within, length);
+        copied += length;
+        position_ += length;
+        if (within + length == blockEnd) {
+            ready_ = false;
+            queue(block);
+        }
+    }
+    return copied;
+}
+
+#endif // ASYNC_IO_H
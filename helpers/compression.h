@@ -0,0 +1,268 @@
+/*
+* Compression of file contents ahead of encryption.
+*
+* Contents are stored as their size (8 bytes, native byte order) followed by a raw deflate
+* stream at the fastest level. Encryption authenticates the result, so the stream carries
+* no checksum of its own.
+*
+* The stream can only be read from its start, so reading any part of a compressed file
+* means inflating it whole. Contents of kMaxSize bytes or more are therefore never
+* compressed: large files keep chunks that can be read, rewritten and appended to one by one.
+*/
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <zlib.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+class Compression {
+public:
+    static constexpr size_t kMinSize = 512;
+    static constexpr size_t kMaxSize = 1024 * 1024;
+    static constexpr size_t kSampleSize = 64 * 1024;
+    static constexpr size_t kSizePrefix = sizeof(uint64_t);
+
+    /// Compress content if it is at least kMinSize but under kMaxSize bytes and compresses by
+    /// at least an eighth. Contents whose first kSampleSize bytes are spread almost evenly
+    /// over all byte values are not tried, and the start of large contents is tried first, so
+    /// incompressible data is rejected cheaply. EFS_COMPRESSION=off turns compression off.
+    /// \return False if content should be stored as is
+    static bool compress(const std::string& content, std::string& compressed);
+
+    /// Restore contents written by compress
+    /// \return False if data is not a complete stream of the recorded size
+    static bool decompress(const unsigned char* data, size_t size, std::string& content);
+
+    /// Decompresses a stream fed in pieces, writing contents out as they are restored
+    class Inflater {
+    public:
+        explicit Inflater(std::ostream& output);
+        ~Inflater() { inflateEnd(&stream_); }
+
+        Inflater(const Inflater&) = delete;
+        Inflater& operator=(const Inflater&) = delete;
+
+        /// \return False if the data is corrupt or runs past the end of the stream
+        bool update(const unsigned char* data, size_t size);
+
+        /// \return False if the stream ended early or restored the wrong number of bytes
+        bool finish();
+
+    private:
+        std::ostream& output_;
+        z_stream stream_{};
+        bool ready_ = false;
+        bool ended_ = false;
+        unsigned char prefix_[kSizePrefix];
+        size_t prefixLength_ = 0;
+        uint64_t expected_ = 0;
+        uint64_t written_ = 0;
+    };
+
+private:
+    static bool enabled();
+
+    /// Whether the bytes of data carry more than 7.5 bits of entropy each, which leaves
+    /// deflate no room to save an eighth
+    static bool looksIncompressible(const unsigned char* data, size_t size);
+
+    /// Raw deflate of size bytes appended to output
+    static bool deflateInto(const unsigned char* data, size_t size, std::string& output);
+};
+
+bool Compression::enabled() {
+    static const bool enabled = [] {
+        const char* configured = std::getenv("EFS_COMPRESSION");
+        return configured == nullptr || std::strcmp(configured, "off") != 0;
+    }();
+    return enabled;
+}
+
+bool Compression::compress(const std::string& content, std::string& compressed) {
+    if (!enabled() || content.size() < kMinSize || content.size() >= kMaxSize) {
+        return false;
+    }
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(content.data());
+    if (looksIncompressible(data, std::min(content.size(), kSampleSize))) {
+        return false;
+    }
+    if (content.size() > kSampleSize) {
+        std::string sample;
+        if (!deflateInto(data, kSampleSize, sample) || sample.size() > kSampleSize - kSampleSize / 8) {
+            return false;
+        }
+    }
+
+    uint64_t size = content.size();
+    compressed.assign(reinterpret_cast<const char*>(&size), kSizePrefix);
+    if (!deflateInto(data, content.size(), compressed)) {
+        return false;
+    }
+    return compressed.size() <= content.size() - content.size() / 8;
+}
+
+bool Compression::looksIncompressible(const unsigned char* data, size_t size) {
+    size_t counts[256] = {};
+    for (size_t i = 0; i < size; ++i) {
+        ++counts[data[i]];
+    }
+    double entropy = 0;
+    for (size_t count : counts) {
+        if (count != 0) {
+            double p = static_cast<double>(count) / size;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy > 7.5;
+}
+
+bool Compression::deflateInto(const unsigned char* data, size_t size, std::string& output) {
+    // A window no larger than the input finds the same matches, and small contents then skip
+    // clearing zlib's full-size window and hash table, which costs more than compressing
+    // them. Inflating needs no change, as its window is always the largest.
+    int windowBits = 9;
+    while (windowBits < MAX_WBITS && (size_t{1} << windowBits) < size) {
+        ++windowBits;
+    }
+    z_stream stream{};
+    if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, -windowBits, windowBits - 7, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    size_t start = output.size();
+    output.resize(start + deflateBound(&stream, static_cast<uLong>(size)));
+
+    // zlib counts in uInt, so larger buffers are handed over a piece at a time.
+    size_t consumed = 0;
+    int status = Z_OK;
+    do {
+        if (stream.avail_in == 0 && consumed < size) {
+            stream.next_in = const_cast<unsigned char*>(data + consumed);
+            stream.avail_in = static_cast<uInt>(std::min<size_t>(size - consumed, UINT_MAX));
+            consumed += stream.avail_in;
+        }
+        if (stream.avail_out == 0) {
+            if (start + stream.total_out == output.size()) {
+                output.resize(output.size() + output.size() / 2 + 64);
+            }
+            stream.next_out = reinterpret_cast<unsigned char*>(&output[start + stream.total_out]);
+            stream.avail_out = static_cast<uInt>(std::min<size_t>(output.size() - start - stream.total_out, UINT_MAX));
+        }
+        status = deflate(&stream, consumed == size ? Z_FINISH : Z_NO_FLUSH);
+    } while (status == Z_OK || status == Z_BUF_ERROR);
+
+    output.resize(start + stream.total_out);
+    deflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
+
+bool Compression::decompress(const unsigned char* data, size_t size, std::string& content) {
+    uint64_t expected = 0;
+    if (size < kSizePrefix) {
+        return false;
+    }
+    std::memcpy(&expected, data, kSizePrefix);
+
+    z_stream stream{};
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        return false;
+    }
+    content.assign(expected, '\0');
+
+    // Once content is full, output goes to a spare byte: inflate may still need a call to
+    // reach the end of the stream, and anything written there means the stream is too long.
+    unsigned char spare;
+    size_t consumed = kSizePrefix;
+    int status = Z_OK;
+    do {
+        if (stream.avail_in == 0 && consumed < size) {
+            stream.next_in = const_cast<unsigned char*>(data + consumed);
+            stream.avail_in = static_cast<uInt>(std::min<size_t>(size - consumed, UINT_MAX));
+            consumed += stream.avail_in;
+        }
+        if (stream.avail_out == 0) {
+            if (stream.total_out > content.size()) {
+                break;
+            }
+            size_t remaining = content.size() - stream.total_out;
+            stream.next_out = remaining > 0 ? reinterpret_cast<unsigned char*>(&content[stream.total_out]) : &spare;
+            stream.avail_out = remaining > 0 ? static_cast<uInt>(std::min<size_t>(remaining, UINT_MAX)) : 1;
+        }
+        status = inflate(&stream, Z_NO_FLUSH);
+    } while (status == Z_OK);
+
+    bool ok = status == Z_STREAM_END && stream.total_out == content.size() && stream.avail_in == 0 && consumed == size;
+    inflateEnd(&stream);
+    return ok;
+}
+
+Compression::Inflater::Inflater(std::ostream& output) : output_(output) {
+    ready_ = inflateInit2(&stream_, -MAX_WBITS) == Z_OK;
+}
+
+bool Compression::Inflater::update(const unsigned char* data, size_t size) {
+    if (!ready_) {
+        return false;
+    }
+    if (prefixLength_ < kSizePrefix) {
+        size_t length = std::min(size, kSizePrefix - prefixLength_);
+        std::memcpy(prefix_ + prefixLength_, data, length);
+        prefixLength_ += length;
+        data += length;
+        size -= length;
+        if (prefixLength_ == kSizePrefix) {
+            std::memcpy(&expected_, prefix_, kSizePrefix);
+        }
+    }
+
+    unsigned char buffer[64 * 1024];
+    while (size > 0) {
+        if (ended_) {
+            return false;
+        }
+        stream_.next_in = const_cast<unsigned char*>(data);
+        stream_.avail_in = static_cast<uInt>(std::min<size_t>(size, UINT_MAX));
+        size_t fed = stream_.avail_in;
+        do {
+            stream_.next_out = buffer;
+            stream_.avail_out = sizeof(buffer);
+            int status = inflate(&stream_, Z_NO_FLUSH);
+            if (status == Z_BUF_ERROR) {
+                break; // Everything fed so far has been restored.
+            }
+            if (status != Z_OK && status != Z_STREAM_END) {
+                return false;
+            }
+            size_t produced = sizeof(buffer) - stream_.avail_out;
+            written_ += produced;
+            if (written_ > expected_) {
+                return false;
+            }
+            output_.write(reinterpret_cast<const char*>(buffer), produced);
+            if (status == Z_STREAM_END) {
+                ended_ = true;
+                break;
+            }
+        } while (stream_.avail_out == 0 || stream_.avail_in > 0);
+        if (ended_ && stream_.avail_in > 0) {
+            return false;
+        }
+        data += fed;
+        size -= fed;
+    }
+    return true;
+}
+
+bool Compression::Inflater::finish() {
+    return ready_ && ended_ && written_ == expected_;
+}
+
+#endif // COMPRESSION_H
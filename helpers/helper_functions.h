@@ -17,6 +17,7 @@
 #include <unistd.h>
 
 #include "encryption/encryption.h"
+#include "encryption/keyring.h"
 #include "encryption/randomizer_function.h"
 
 namespace fs = std::filesystem;
@@ -56,19 +57,13 @@ std::string normalizePath(std::string path) {
     return path;
 }
 
-std::vector<uint8_t> readEncKeyFromMetadata(const std::string& userName, const std::string& directory) {
+/// Key of a user, read from disk once per session and then served from the keyring
+/// \param userName    The user whose key to look up
+/// \param directory   Directory holding the key files, "common/" if empty
+/// \return The key, valid until exit, or an empty key if it could not be read
+const std::vector<uint8_t>& readEncKeyFromMetadata(const std::string& userName, const std::string& directory) {
     const std::string metadataFilePath = !directory.empty() ? directory : "common/";
-    std::ifstream metadataFile(metadataFilePath + userName + "_key", std::ios::in | std::ios::binary);
-
-    if (!metadataFile) {
-        std::cerr << "Failed to read key from metadata for " << userName << std::endl;
-        return {}; // Return an empty vector if the file failed to open
-    }
-
-    std::vector<uint8_t> encryptionKey(KEY_SIZE);
-    metadataFile.read(reinterpret_cast<char*>(encryptionKey.data()), encryptionKey.size());
-
-    return encryptionKey;
+    return Keyring::session().get(userName, metadataFilePath, KEY_SIZE);
 }
 
 bool isValidFilename(const std::string& filename) {
@@ -0,0 +1,72 @@
+/*
+* Bounded least-recently-used cache.
+*/
+
+#ifndef LRU_CACHE_H
+#define LRU_CACHE_H
+
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+template <typename Key, typename Value>
+class LruCache {
+public:
+    explicit LruCache(size_t capacity) : capacity_(capacity) {}
+
+    /// Look up a key and mark it as most recently used
+    /// \return Pointer to the cached value, or nullptr on a miss
+    const Value* get(const Key& key);
+
+    /// Insert or replace a value, evicting the least recently used entry when full
+    void put(const Key& key, Value value);
+
+    void clear();
+    size_t size() const { return index_.size(); }
+
+private:
+    using Item = std::pair<Key, Value>;
+
+    size_t capacity_;
+    std::list<Item> items_;
+    std::unordered_map<Key, typename std::list<Item>::iterator> index_;
+};
+
+template <typename Key, typename Value>
+const Value* LruCache<Key, Value>::get(const Key& key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        return nullptr;
+    }
+    items_.splice(items_.begin(), items_, it->second);
+    return &it->second->second;
+}
+
+template <typename Key, typename Value>
+void LruCache<Key, Value>::put(const Key& key, Value value) {
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        it->second->second = std::move(value);
+        items_.splice(items_.begin(), items_, it->second);
+        return;
+    }
+
+    if (capacity_ == 0) {
+        return;
+    }
+    if (index_.size() >= capacity_) {
+        index_.erase(items_.back().first);
+        items_.pop_back();
+    }
+    items_.emplace_front(key, std::move(value));
+    index_.emplace(key, items_.begin());
+}
+
+template <typename Key, typename Value>
+void LruCache<Key, Value>::clear() {
+    items_.clear();
+    index_.clear();
+}
+
+#endif // LRU_CACHE_H
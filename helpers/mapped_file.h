@@ -0,0 +1,97 @@
+/*
+* Read-only memory mapping of a whole file. The file stays open while it is mapped, so
+* callers can also read it with pread or AsyncIo.
+*/
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /// Map filePath for reading. Empty files open successfully with no mapping.
+    /// \return False if the file could not be opened or mapped
+    bool open(const std::string& filePath);
+    void close();
+
+    /// Tell the kernel how the mapping will be read (MADV_*). Only a hint; errors are ignored.
+    void advise(int advice) const;
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    /// The open file, or -1 if the file is empty or nothing is open
+    int descriptor() const { return fd_; }
+
+    /// Last modification time of the file, in nanoseconds since the Unix epoch
+    int64_t modifiedNs() const { return modifiedNs_; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    int fd_ = -1;
+    int64_t modifiedNs_ = 0;
+};
+
+bool MappedFile::open(const std::string& filePath) {
+    close();
+
+    int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0) {
+        ::close(fd);
+        return false;
+    }
+    modifiedNs_ = static_cast<int64_t>(fileInfo.st_mtim.tv_sec) * 1000000000 + fileInfo.st_mtim.tv_nsec;
+    if (fileInfo.st_size == 0) {
+        ::close(fd);
+        return true;
+    }
+
+    void* mapping = mmap(nullptr, static_cast<size_t>(fileInfo.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        ::close(fd);
+        return false;
+    }
+    data_ = static_cast<const uint8_t*>(mapping);
+    fd_ = fd;
+    size_ = static_cast<size_t>(fileInfo.st_size);
+    return true;
+}
+
+void MappedFile::advise(int advice) const {
+    if (data_ != nullptr) {
+        madvise(const_cast<uint8_t*>(data_), size_, advice);
+    }
+}
+
+void MappedFile::close() {
+    if (data_ != nullptr) {
+        munmap(const_cast<uint8_t*>(data_), size_);
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    data_ = nullptr;
+    fd_ = -1;
+    size_ = 0;
+    modifiedNs_ = 0;
+}
+
+#endif // MAPPED_FILE_H
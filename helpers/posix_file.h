@@ -0,0 +1,179 @@
+/*
+* Unbuffered file I/O over a POSIX descriptor, for callers that already hold whole records in
+* memory and want each one to reach the kernel in a single call.
+*/
+
+#ifndef POSIX_FILE_H
+#define POSIX_FILE_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class PosixFile {
+public:
+    PosixFile() = default;
+    ~PosixFile() { close(); }
+
+    PosixFile(const PosixFile&) = delete;
+    PosixFile& operator=(const PosixFile&) = delete;
+
+    /// Open filePath for reading
+    /// \return False if the file could not be opened
+    bool openForRead(const std::string& filePath);
+
+    /// Create filePath, or truncate it if it exists, for writing
+    /// \return False if the file could not be opened
+    bool openForWrite(const std::string& filePath);
+
+    /// Open an existing file for reading and writing in place
+    /// \return False if the file could not be opened
+    bool openForUpdate(const std::string& filePath);
+
+    /// Close the file, reporting errors from writes the kernel deferred
+    /// \return False if closing failed
+    bool close();
+
+    bool isOpen() const { return fd_ >= 0; }
+    int descriptor() const { return fd_; }
+
+    /// \return False if the size could not be read
+    bool size(uint64_t& size) const;
+
+    /// Read exactly length bytes at offset, retrying short reads
+    /// \return False on error or if the file ends first
+    bool readAt(void* buffer, size_t length, uint64_t offset) const;
+
+    /// Write all of length bytes at offset, retrying short writes
+    bool writeAt(const void* buffer, size_t length, uint64_t offset);
+
+    /// Write at the end of what this object has written so far
+    bool append(const void* buffer, size_t length);
+
+    /// Cut the file to size bytes, or extend it with zeros
+    bool truncate(uint64_t size);
+
+    /// Wait until the file's contents, and its size if it grew, are on disk
+    /// \return False if they could not be written
+    bool sync();
+
+    /// Tell the kernel how a range will be accessed (POSIX_FADV_*). Only a hint; errors are
+    /// ignored. A length of 0 means up to the end of the file.
+    void advise(int advice, uint64_t offset = 0, uint64_t length = 0) const;
+
+private:
+    int fd_ = -1;
+    uint64_t end_ = 0;
+};
+
+bool PosixFile::openForRead(const std::string& filePath) {
+    close();
+    fd_ = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    return fd_ >= 0;
+}
+
+bool PosixFile::openForWrite(const std::string& filePath) {
+    close();
+    fd_ = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    end_ = 0;
+    return fd_ >= 0;
+}
+
+bool PosixFile::openForUpdate(const std::string& filePath) {
+    close();
+    fd_ = ::open(filePath.c_str(), O_RDWR | O_CLOEXEC);
+    end_ = 0;
+    return fd_ >= 0;
+}
+
+bool PosixFile::close() {
+    if (fd_ < 0) {
+        return true;
+    }
+    int result = ::close(fd_);
+    fd_ = -1;
+    return result == 0;
+}
+
+bool PosixFile::size(uint64_t& size) const {
+    struct stat fileInfo;
+    if (fstat(fd_, &fileInfo) != 0) {
+        return false;
+    }
+    size = static_cast<uint64_t>(fileInfo.st_size);
+    return true;
+}
+
+bool PosixFile::readAt(void* buffer, size_t length, uint64_t offset) const {
+    char* target = static_cast<char*>(buffer);
+    while (length > 0) {
+        ssize_t count = ::pread(fd_, target, length, static_cast<off_t>(offset));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        target += count;
+        length -= static_cast<size_t>(count);
+        offset += static_cast<uint64_t>(count);
+    }
+    return true;
+}
+
+bool PosixFile::writeAt(const void* buffer, size_t length, uint64_t offset) {
+    const char* source = static_cast<const char*>(buffer);
+    while (length > 0) {
+        ssize_t count = ::pwrite(fd_, source, length, static_cast<off_t>(offset));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        source += count;
+        length -= static_cast<size_t>(count);
+        offset += static_cast<uint64_t>(count);
+    }
+    return true;
+}
+
+bool PosixFile::append(const void* buffer, size_t length) {
+    if (!writeAt(buffer, length, end_)) {
+        return false;
+    }
+    end_ += length;
+    return true;
+}
+
+bool PosixFile::truncate(uint64_t size) {
+    int result;
+    do {
+        result = ::ftruncate(fd_, static_cast<off_t>(size));
+    } while (result != 0 && errno == EINTR);
+    return result == 0;
+}
+
+bool PosixFile::sync() {
+    int result;
+    do {
+        result = ::fdatasync(fd_);
+    } while (result != 0 && errno == EINTR);
+    return result == 0;
+}
+
+void PosixFile::advise(int advice, uint64_t offset, uint64_t length) const {
+#if defined(POSIX_FADV_NORMAL)
+    posix_fadvise(fd_, static_cast<off_t>(offset), static_cast<off_t>(length), advice);
+#else
+    (void)advice;
+    (void)offset;
+    (void)length;
+#endif
+}
+
+#endif // POSIX_FILE_H
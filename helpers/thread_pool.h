@@ -0,0 +1,166 @@
+/*
+* Fixed-size worker pool for data-parallel loops and background tasks.
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t workers);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /// Process-wide pool with one thread per core, counting the caller. EFS_WORKER_THREADS
+    /// overrides the thread count.
+    static ThreadPool& shared();
+
+    /// Number of threads that run a parallelFor, counting the caller
+    size_t concurrency() const { return workers_.size() + 1; }
+
+    /// Run body(i) for every i in [0, count) and wait for all of them. The calling thread
+    /// takes part; the first exception thrown by body is rethrown here.
+    template <typename Body>
+    void parallelFor(size_t count, Body&& body);
+
+    /// Run task on a worker without waiting for it; a pool without workers runs it here.
+    /// task must not throw.
+    void submit(std::function<void()> task);
+
+private:
+    void run();
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+};
+
+ThreadPool::ThreadPool(size_t workers) {
+    workers_.reserve(workers);
+    for (size_t i = 0; i < workers; ++i) {
+        workers_.emplace_back(&ThreadPool::run, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+ThreadPool& ThreadPool::shared() {
+    static ThreadPool pool([] {
+        size_t threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+        if (const char* configured = std::getenv("EFS_WORKER_THREADS")) {
+            threads = std::max<long>(1, std::strtol(configured, nullptr, 10));
+        }
+        return threads - 1;
+    }());
+    return pool;
+}
+
+void ThreadPool::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        wake_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+        if (tasks_.empty()) {
+            return;
+        }
+        std::function<void()> task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    if (workers_.empty()) {
+        task();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    wake_.notify_one();
+}
+
+template <typename Body>
+void ThreadPool::parallelFor(size_t count, Body&& body) {
+    size_t helpers = std::min(workers_.size(), count > 0 ? count - 1 : 0);
+    if (helpers == 0) {
+        for (size_t i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+
+    // Threads claim indexes one at a time, so uneven items still balance out.
+    struct Loop {
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t running = 0;
+        std::exception_ptr error;
+    };
+    auto loop = std::make_shared<Loop>();
+    loop->running = helpers + 1;
+
+    auto work = [loop, count, &body] {
+        for (size_t i = loop->next++; i < count; i = loop->next++) {
+            try {
+                body(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(loop->mutex);
+                if (!loop->error) {
+                    loop->error = std::current_exception();
+                }
+                loop->next = count;
+            }
+        }
+        std::lock_guard<std::mutex> lock(loop->mutex);
+        if (--loop->running == 0) {
+            loop->done.notify_all();
+        }
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < helpers; ++i) {
+            tasks_.emplace_back(work);
+        }
+    }
+    wake_.notify_all();
+    work();
+
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    loop->done.wait(lock, [&] { return loop->running == 0; });
+    if (loop->error) {
+        std::rethrow_exception(loop->error);
+    }
+}
+
+#endif // THREAD_POOL_H
@@ -40,13 +40,10 @@ int main(int argc, char *argv[]) {
             return 1;
         }
 
-    std::string metadataPath = "common/structure.json";
-    std::ofstream metadataFile(metadataPath);
-    if (metadataFile) {
-        metadataFile << "{\"test\":\"123\"}";
-        metadataFile.close();
-    } else {
-        std::cerr << "Error creating structure.json\n" << std::endl;
+    try {
+        MetadataSnapshot::Write("common/structure.bin", {});
+    } catch (const std::exception& e) {
+        std::cerr << "Error creating structure.bin\n" << std::endl;
         return 1;
     }
 
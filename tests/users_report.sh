@@ -0,0 +1,24 @@
+#!/bin/sh
+# The admin "users" report counts a shared file toward its owner's size only.
+# Usage: users_report.sh <path to fileserver>
+set -eu
+
+fileserver=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+workdir=$(mktemp -d)
+trap 'rm -rf "$workdir"' EXIT
+cd "$workdir"
+
+printf 'adduser alice\nadduser bob\nexit\n' | "$fileserver" > /dev/null
+printf 'cd personal\nmkfile notes.txt replaced\nshare notes.txt alice\nexit\n' | "$fileserver" bob_keyfile > /dev/null
+printf 'cd personal\nmkfile own.txt abc\nexit\n' | "$fileserver" alice_keyfile > /dev/null
+report=$(printf 'users\nexit\n' | "$fileserver" admin_keyfile)
+
+# alice: personal, shared, own.txt and the link to bob's file; only own.txt is hers
+# bob: personal, shared and notes.txt
+for expected in "alice 4 3" "bob 3 8"; do
+    if ! printf '%s\n' "$report" | grep -q "$expected\$"; then
+        echo "expected \"$expected\" in:" >&2
+        printf '%s\n' "$report" >&2
+        exit 1
+    fi
+done